@@ -0,0 +1,357 @@
+#include "bigint.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <utility>
+
+namespace
+{
+using limbs_t = std::vector<uint32_t>;
+
+constexpr uint64_t kBASE{uint64_t{1} << 32};
+// the largest power of ten in a limb, decimal text is converted 9 digits at
+// a time
+constexpr uint32_t kDECIMAL_BASE{1'000'000'000};
+constexpr size_t kDECIMAL_DIGITS{9};
+
+void Trim(limbs_t &a)
+{
+	while (!a.empty() && !a.back())
+		a.pop_back();
+}
+
+std::strong_ordering CompareMag(const limbs_t &a, const limbs_t &b)
+{
+	if (a.size() != b.size())
+		return a.size() <=> b.size();
+	for (size_t i{a.size()}; i > 0; i--)
+		if (a[i - 1] != b[i - 1])
+			return a[i - 1] <=> b[i - 1];
+	return std::strong_ordering::equal;
+}
+
+limbs_t AddMag(const limbs_t &a, const limbs_t &b)
+{
+	const limbs_t &big{a.size() < b.size() ? b : a};
+	const limbs_t &small{a.size() < b.size() ? a : b};
+	limbs_t ret(big.size() + 1);
+	uint64_t carry{};
+	for (size_t i{0}; i < big.size(); i++)
+	{
+		carry += uint64_t{big[i]} + (i < small.size() ? small[i] : 0);
+		ret[i] = static_cast<uint32_t>(carry);
+		carry >>= 32;
+	}
+	ret.back() = static_cast<uint32_t>(carry);
+	Trim(ret);
+	return ret;
+}
+
+// a - b, a can't be smaller than b
+limbs_t SubMag(const limbs_t &a, const limbs_t &b)
+{
+	limbs_t ret(a.size());
+	int64_t borrow{};
+	for (size_t i{0}; i < a.size(); i++)
+	{
+		int64_t diff{int64_t{a[i]} - borrow - (i < b.size() ? b[i] : 0)};
+		borrow = diff < 0;
+		ret[i] = static_cast<uint32_t>(diff);
+	}
+	Trim(ret);
+	return ret;
+}
+
+limbs_t MulMag(const limbs_t &a, const limbs_t &b)
+{
+	if (a.empty() || b.empty())
+		return {};
+	limbs_t ret(a.size() + b.size());
+	for (size_t i{0}; i < a.size(); i++)
+	{
+		uint64_t carry{};
+		for (size_t j{0}; j < b.size(); j++)
+		{
+			carry += uint64_t{a[i]} * b[j] + ret[i + j];
+			ret[i + j] = static_cast<uint32_t>(carry);
+			carry >>= 32;
+		}
+		ret[i + b.size()] = static_cast<uint32_t>(carry);
+	}
+	Trim(ret);
+	return ret;
+}
+
+// a = a * mul + add
+void MulAddSmall(limbs_t &a, uint32_t mul, uint32_t add)
+{
+	uint64_t carry{add};
+	for (uint32_t &i : a)
+	{
+		carry += uint64_t{i} * mul;
+		i = static_cast<uint32_t>(carry);
+		carry >>= 32;
+	}
+	if (carry)
+		a.push_back(static_cast<uint32_t>(carry));
+}
+
+// a = a / div, returns the remainder
+uint32_t DivSmall(limbs_t &a, uint32_t div)
+{
+	uint64_t rem{};
+	for (size_t i{a.size()}; i > 0; i--)
+	{
+		const uint64_t cur{rem << 32 | a[i - 1]};
+		a[i - 1] = static_cast<uint32_t>(cur / div);
+		rem = cur % div;
+	}
+	Trim(a);
+	return static_cast<uint32_t>(rem);
+}
+
+// Long division, algorithm D from Knuth's TAOCP volume 2. b can't be zero
+limbs_t DivMag(const limbs_t &a, const limbs_t &b)
+{
+	if (CompareMag(a, b) < 0)
+		return {};
+	if (b.size() == 1)
+	{
+		limbs_t ret{a};
+		DivSmall(ret, b[0]);
+		return ret;
+	}
+
+	// normalize so the top limb of the divisor has its high bit set, that
+	// keeps the estimated quotient digits at most 2 off
+	const int shift{std::countl_zero(b.back())};
+	auto shifted = [shift](const limbs_t &x, size_t size)
+	{
+		limbs_t ret(size);
+		for (size_t i{0}; i < x.size(); i++)
+		{
+			ret[i] |= x[i] << shift;
+			if (shift && i + 1 < size)
+				ret[i + 1] = x[i] >> (32 - shift);
+		}
+		return ret;
+	};
+	const size_t n{b.size()};
+	const size_t m{a.size() - n};
+	const limbs_t v{shifted(b, n)};
+	limbs_t u{shifted(a, a.size() + 1)};
+	limbs_t q(m + 1);
+
+	for (size_t j{m + 1}; j > 0; j--)
+	{
+		const size_t k{j - 1};
+		const uint64_t top{uint64_t{u[k + n]} << 32 | u[k + n - 1]};
+		uint64_t qhat{top / v[n - 1]};
+		uint64_t rhat{top % v[n - 1]};
+		while (qhat >= kBASE || qhat * v[n - 2] > (rhat << 32 | u[k + n - 2]))
+		{
+			qhat--;
+			rhat += v[n - 1];
+			if (rhat >= kBASE)
+				break;
+		}
+
+		// u -= qhat * v, shifted to k
+		int64_t borrow{};
+		uint64_t carry{};
+		for (size_t i{0}; i < n; i++)
+		{
+			const uint64_t product{qhat * v[i] + carry};
+			carry = product >> 32;
+			const int64_t diff{int64_t{u[i + k]} - borrow -
+							   static_cast<int64_t>(product & 0xFFFFFFFF)};
+			borrow = diff < 0;
+			u[i + k] = static_cast<uint32_t>(diff);
+		}
+		const int64_t diff{int64_t{u[k + n]} - borrow -
+						   static_cast<int64_t>(carry)};
+		u[k + n] = static_cast<uint32_t>(diff);
+
+		// qhat was still one too big, add v back
+		if (diff < 0)
+		{
+			qhat--;
+			carry = 0;
+			for (size_t i{0}; i < n; i++)
+			{
+				carry += uint64_t{u[i + k]} + v[i];
+				u[i + k] = static_cast<uint32_t>(carry);
+				carry >>= 32;
+			}
+			u[k + n] += static_cast<uint32_t>(carry);
+		}
+		q[k] = static_cast<uint32_t>(qhat);
+	}
+	Trim(q);
+	return q;
+}
+}  // namespace
+
+BigInt::BigInt(int64_t val) : negative_{val < 0}
+{
+	// negated as unsigned so INT64_MIN doesn't overflow
+	uint64_t mag{static_cast<uint64_t>(val)};
+	if (negative_)
+		mag = ~mag + 1;
+	for (; mag; mag >>= 32)
+		limbs_.push_back(static_cast<uint32_t>(mag));
+}
+
+BigInt BigInt::parse(std::wstring_view str)
+{
+	BigInt ret{};
+	const bool negative{str.starts_with(L'-')};
+	if (negative || str.starts_with(L'+'))
+		str.remove_prefix(1);
+
+	// the first chunk takes whatever doesn't divide into whole chunks
+	size_t chunk{str.size() % kDECIMAL_DIGITS};
+	if (!chunk)
+		chunk = kDECIMAL_DIGITS;
+	while (!str.empty())
+	{
+		uint32_t val{};
+		uint32_t scale{1};
+		for (wchar_t c : str.substr(0, chunk))
+		{
+			val = val * 10 + (c - L'0');
+			scale *= 10;
+		}
+		MulAddSmall(ret.limbs_, scale, val);
+		str.remove_prefix(chunk);
+		chunk = kDECIMAL_DIGITS;
+	}
+	Trim(ret.limbs_);
+	ret.negative_ = negative && !ret.limbs_.empty();
+	return ret;
+}
+
+std::optional<int64_t> BigInt::to_int() const
+{
+	if (limbs_.size() > 2)
+		return {};
+	uint64_t mag{};
+	for (size_t i{limbs_.size()}; i > 0; i--)
+		mag = mag << 32 | limbs_[i - 1];
+	// one more fits on the negative side
+	if (mag > uint64_t{INT64_MAX} + negative_)
+		return {};
+	return static_cast<int64_t>(negative_ ? ~mag + 1 : mag);
+}
+
+BigInt operator+(const BigInt &l, const BigInt &r)
+{
+	BigInt ret{};
+	if (l.negative_ == r.negative_)
+	{
+		ret.limbs_ = AddMag(l.limbs_, r.limbs_);
+		ret.negative_ = l.negative_;
+	}
+	else if (CompareMag(l.limbs_, r.limbs_) >= 0)
+	{
+		ret.limbs_ = SubMag(l.limbs_, r.limbs_);
+		ret.negative_ = l.negative_;
+	}
+	else
+	{
+		ret.limbs_ = SubMag(r.limbs_, l.limbs_);
+		ret.negative_ = r.negative_;
+	}
+	ret.negative_ &= !ret.limbs_.empty();
+	return ret;
+}
+
+BigInt operator-(const BigInt &l, const BigInt &r)
+{
+	BigInt negated{r};
+	negated.negative_ = !r.negative_ && !r.limbs_.empty();
+	return l + negated;
+}
+
+BigInt operator*(const BigInt &l, const BigInt &r)
+{
+	BigInt ret{};
+	ret.limbs_ = MulMag(l.limbs_, r.limbs_);
+	ret.negative_ = l.negative_ != r.negative_ && !ret.limbs_.empty();
+	return ret;
+}
+
+BigInt operator/(const BigInt &l, const BigInt &r)
+{
+	BigInt ret{};
+	ret.limbs_ = DivMag(l.limbs_, r.limbs_);
+	ret.negative_ = l.negative_ != r.negative_ && !ret.limbs_.empty();
+	return ret;
+}
+
+BigInt BigInt::pow(uint64_t exp) const
+{
+	BigInt ret{1};
+	BigInt base{*this};
+	while (exp)
+	{
+		if (exp & 1)
+			ret = ret * base;
+		exp >>= 1;
+		if (exp)
+			base = base * base;
+	}
+	return ret;
+}
+
+BigInt BigInt::isqrt() const
+{
+	if (limbs_.empty())
+		return {};
+
+	// newtons method from above, 2^ceil(bits / 2) is at least the root and
+	// the estimates shrink until they reach it
+	const size_t bits{limbs_.size() * 32 - std::countl_zero(limbs_.back())};
+	const size_t half{(bits + 1) / 2};
+	BigInt x{};
+	x.limbs_.resize(half / 32 + 1);
+	x.limbs_.back() = uint32_t{1} << half % 32;
+	while (true)
+	{
+		BigInt next{x + *this / x};
+		DivSmall(next.limbs_, 2);
+		if (next >= x)
+			return x;
+		x = std::move(next);
+	}
+}
+
+std::strong_ordering BigInt::operator<=>(const BigInt &other) const
+{
+	if (negative_ != other.negative_)
+		return other.negative_ <=> negative_;
+	return negative_ ? CompareMag(other.limbs_, limbs_)
+					 : CompareMag(limbs_, other.limbs_);
+}
+
+std::wstring BigInt::to_string() const
+{
+	if (limbs_.empty())
+		return L"0";
+
+	// peeled off 9 digits at a time, least significant first
+	std::vector<uint32_t> chunks{};
+	limbs_t mag{limbs_};
+	while (!mag.empty())
+		chunks.push_back(DivSmall(mag, kDECIMAL_BASE));
+
+	std::wstring ret{negative_ ? L"-" : L""};
+	ret += std::to_wstring(chunks.back());
+	for (size_t i{chunks.size() - 1}; i > 0; i--)
+	{
+		const std::wstring chunk{std::to_wstring(chunks[i - 1])};
+		ret.append(kDECIMAL_DIGITS - chunk.size(), L'0');
+		ret += chunk;
+	}
+	return ret;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <compare>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// An arbitrary precision integer, what an INT becomes once it doesn't fit in
+// 64 bits. Immutable, every operation makes a new one
+class BigInt
+{
+public:
+	BigInt() = default;
+	explicit BigInt(int64_t val);
+
+	/**
+	 * @brief the value of an optionally signed run of decimal digits, the
+	 *string has to be one
+	 **/
+	static BigInt parse(std::wstring_view str);
+
+	// the value, if it fits in an int64_t
+	std::optional<int64_t> to_int() const;
+
+	bool negative() const
+	{
+		return negative_;
+	}
+
+	friend BigInt operator+(const BigInt &l, const BigInt &r);
+	friend BigInt operator-(const BigInt &l, const BigInt &r);
+	friend BigInt operator*(const BigInt &l, const BigInt &r);
+	// rounds towards zero like int division does, r can't be zero
+	friend BigInt operator/(const BigInt &l, const BigInt &r);
+
+	// by squaring, one multiplication per bit of exp
+	BigInt pow(uint64_t exp) const;
+
+	/**
+	 * @brief the largest integer whose square is at most this, this can't be
+	 *negative
+	 **/
+	BigInt isqrt() const;
+
+	std::strong_ordering operator<=>(const BigInt &other) const;
+	bool operator==(const BigInt &other) const = default;
+
+	std::wstring to_string() const;
+
+private:
+	bool negative_{};
+	// the magnitude, least significant limb first and without leading zero
+	// limbs, so zero has none
+	std::vector<uint32_t> limbs_{};
+};
@@ -0,0 +1,442 @@
+#include "bytecode.hpp"
+
+#include <cassert>
+#include <limits>
+#include <memory>
+#include <span>
+
+#include "interpreter.hpp"
+#include "structs.hpp"
+
+namespace
+{
+// Lowers a single form into a chunk, the layout of the emitted code
+// mirrors Interpreter::walk so both engines fail the same way
+class compiler_t
+{
+public:
+	std::shared_ptr<chunk_t> chunk_{std::make_shared<chunk_t>()};
+	// the argument lists of the lambdas being compiled, innermost last
+	std::vector<const token_t *> scopes_{};
+	bool global_{};
+
+	void form(const token_t &token);
+
+private:
+	uint32_t emit(OPCODE op, uint32_t a = 0, uint32_t b = 0)
+	{
+		chunk_->code.push_back(instr_t{.op = op, .a = a, .b = b});
+		return chunk_->code.size() - 1;
+	}
+
+	uint32_t emit_error(OPCODE op, EvalError err, uint32_t a = 0)
+	{
+		chunk_->errors.push_back(std::move(err));
+		assert(chunk_->errors.size() <=
+			   std::numeric_limits<uint16_t>::max());
+		auto pos{emit(op, a)};
+		chunk_->code[pos].e = chunk_->errors.size() - 1;
+		return pos;
+	}
+
+	uint32_t constant(const token_t &token)
+	{
+		chunk_->constants.push_back(token);
+		chunk_->globals.emplace_back();
+		return chunk_->constants.size() - 1;
+	}
+
+	// a copy of the symbol annotated with where it lives, the same way
+	// Interpreter::resolve would
+	token_t address(const token_t &symbol) const
+	{
+		token_t ret{symbol};
+		size_t depth{0};
+		for (auto scope{scopes_.rbegin()}; scope != scopes_.rend();
+			 scope++, depth++)
+		{
+			const auto &params{(*scope)->apval()};
+			for (size_t i{params.size()}; i > 0; i--)
+				if (params[i - 1].pname == symbol.pname)
+				{
+					// too far to fit in the token, looked up by name
+					if (depth > token_t::kMAX_DEPTH ||
+						i - 1 > token_t::kMAX_SLOT)
+						return ret;
+					ret.scope = SCOPE::LEXICAL;
+					ret.depth = depth;
+					ret.slot = i - 1;
+					return ret;
+				}
+		}
+		if (global_)
+			ret.scope = SCOPE::GLOBAL;
+		return ret;
+	}
+
+	uint32_t here() const
+	{
+		return chunk_->code.size();
+	}
+
+	// points the jump operand of an already emitted instruction here
+	void patch_a(uint32_t pos)
+	{
+		chunk_->code[pos].a = here();
+	}
+
+	void patch_b(uint32_t pos)
+	{
+		chunk_->code[pos].b = here();
+	}
+
+	void list(const token_t &token);
+	void call(const token_t &token, std::span<const token_t> args);
+	bool special(const token_t &token,
+				 const token_t &func,
+				 std::span<const token_t> args);
+	void fallthrough(const token_t &token, std::span<const token_t> args);
+	void closure(const token_t *name,
+				 const token_t &params,
+				 const token_t &body);
+
+	static bool all_symbols(const token_t &list)
+	{
+		for (const token_t &i : list.apval())
+			if (i.type != TOKEN_TYPE::SYMBOL)
+				return false;
+		return true;
+	}
+};
+
+void compiler_t::form(const token_t &token)
+{
+	if (token.quoted)
+	{
+		auto tmp{token};
+		tmp.quoted = false;
+		emit(OPCODE::CONST, constant(tmp));
+		return;
+	}
+
+	switch (token.type)
+	{
+	case TOKEN_TYPE::SYMBOL:
+		emit_error(OPCODE::LOAD,
+				   EvalError{EvalError::Exception::UNDEFINED, token},
+				   constant(address(token)));
+		return;
+	case TOKEN_TYPE::INT:
+	case TOKEN_TYPE::BOOL:
+		emit(OPCODE::CONST, constant(token));
+		return;
+	case TOKEN_TYPE::LIST:
+		list(token);
+		return;
+	case TOKEN_TYPE::LAMBDA:
+	case TOKEN_TYPE::DELIM:
+		emit_error(OPCODE::RAISE,
+				   EvalError{EvalError::Exception::NOTREACHABLE, token});
+		emit(OPCODE::NIL);
+		return;
+	}
+}
+
+void compiler_t::list(const token_t &token)
+{
+	if (token.apval().empty())
+	{
+		emit_error(OPCODE::RAISE,
+				   EvalError{EvalError::Exception::EVAL_EMPTY_LIST, token});
+		emit(OPCODE::NIL);
+		return;
+	}
+
+	const token_t &func{token.apval().front()};
+	std::span<const token_t> args{std::next(token.apval().begin()),
+								  token.apval().end()};
+
+	switch (func.type)
+	{
+	case TOKEN_TYPE::SYMBOL:
+	{
+		// a folded body's head can't be bound
+		if (func.pname == kFOLDED)
+		{
+			special(token, func, args);
+			return;
+		}
+		// a user binding always wins over the builtins, so the special
+		// forms only run when the head is unbound at runtime. Only the
+		// expected path is compiled, the other one is left to the tree
+		// walker. Compiling the args for both would double the code with
+		// every level of nesting
+		auto callee{emit(OPCODE::CALLEE, constant(address(func)))};
+		if (Interpreter::find_builtin(func.pname))
+		{
+			emit(OPCODE::POP);
+			emit(OPCODE::WALK, constant(token));
+			auto done{emit(OPCODE::JUMP)};
+
+			patch_b(callee);
+			if (!special(token, func, args))
+				fallthrough(token, args);
+			patch_a(done);
+			return;
+		}
+
+		auto not_fn{emit(OPCODE::EXPECT_FN)};
+		call(token, args);
+		auto done{emit(OPCODE::JUMP)};
+
+		patch_b(callee);
+		emit(OPCODE::WALK, constant(token));
+
+		patch_a(not_fn);
+		patch_a(done);
+		return;
+	}
+	case TOKEN_TYPE::LAMBDA:
+		emit(OPCODE::CONST, constant(func));
+		call(token, args);
+		return;
+	default:
+		emit_error(OPCODE::RAISE,
+				   EvalError{EvalError::Exception::NOT_A_FUNCTION, func});
+		emit(OPCODE::NIL);
+		return;
+	}
+}
+
+// The callee is on the top of the stack, its arguments are evaluated and
+// bound one at a time, args past the callees argument list are never
+// evaluated. token is the call, a call that goes too deep is reported with it
+void compiler_t::call(const token_t &token, std::span<const token_t> args)
+{
+	emit(OPCODE::FRAME);
+	std::vector<uint32_t> skips{};
+	for (size_t i{0}; i < args.size(); i++)
+	{
+		skips.push_back(emit(OPCODE::ARG, i));
+		form(args[i]);
+		emit(OPCODE::BIND, i);
+	}
+	for (auto i : skips)
+		patch_b(i);
+	emit(OPCODE::CALL, constant(token));
+}
+
+// What default_functions does for a builtin, or when a special form gives up
+// before evaluating anything, evaluate every arg and look for a builtin
+void compiler_t::fallthrough(const token_t &token,
+							 std::span<const token_t> args)
+{
+	for (const token_t &i : args)
+		form(i);
+	emit(OPCODE::BUILTIN, constant(token), args.size());
+}
+
+void compiler_t::closure(const token_t *name,
+						 const token_t &params,
+						 const token_t &body)
+{
+	compiler_t body_compiler{.scopes_{scopes_}, .global_ = global_};
+	body_compiler.scopes_.push_back(&params);
+	body_compiler.form(body);
+	body_compiler.emit(OPCODE::RETURN);
+
+	emit(OPCODE::CLOSURE,
+		 constant(token_t::make_lambda(params.apval(),
+									   std::make_shared<token_t>(body), {},
+									   std::move(body_compiler.chunk_),
+									   name ? name->pname : symbol_t{})));
+}
+
+bool compiler_t::special(const token_t &token,
+						 const token_t &func,
+						 std::span<const token_t> args)
+{
+	using Exception = EvalError::Exception;
+	const symbol_t name{func.pname};
+
+	if (name == kQUIT)
+	{
+		emit_error(OPCODE::RAISE, EvalError{Exception::QUIT, token_t{}});
+		return false;
+	}
+	if (name == kFOLDED)
+	{
+		auto unfolded{emit(OPCODE::JUMP_UNFOLDED)};
+		form(args[0]);
+		auto done{emit(OPCODE::JUMP)};
+		patch_a(unfolded);
+		form(args[1]);
+		patch_a(done);
+		return true;
+	}
+	if (name == kIF)
+	{
+		if (args.size() != 3)
+		{
+			emit_error(OPCODE::RAISE,
+					   EvalError{Exception::INVALID_NUMBER_OF_ARGS,
+								 L"if takes 3 args", func});
+			return false;
+		}
+
+		form(args[0]);
+		auto fail{emit_error(
+			OPCODE::EXPECT_BOOL,
+			EvalError{Exception::INVALID_ARG_TYPES,
+					  L"if takes arg types: Bool any any", token})};
+		auto alt{emit(OPCODE::JUMP_UNLESS)};
+		form(args[1]);
+		auto done{emit(OPCODE::JUMP)};
+		patch_a(alt);
+		form(args[2]);
+		auto done_alt{emit(OPCODE::JUMP)};
+
+		patch_a(fail);
+		emit(OPCODE::FALLBACK, constant(token));
+		patch_a(done);
+		patch_a(done_alt);
+		return true;
+	}
+	if (name == kDEFINE || name == kSET)
+	{
+		const bool define{name == kDEFINE};
+		if (args.size() != 2)
+		{
+			emit_error(OPCODE::RAISE,
+					   EvalError{Exception::INVALID_NUMBER_OF_ARGS,
+								 define ? L"define takes 2 args"
+										: L"set! takes 2 args",
+								 token});
+			return false;
+		}
+		if (args[0].type != TOKEN_TYPE::SYMBOL)
+		{
+			emit_error(OPCODE::RAISE,
+					   EvalError{Exception::INVALID_ARG_TYPES,
+								 define
+									 ? L"Define takes arg types: symbol any"
+									 : L"set takes arg types: symbol any",
+								 token});
+			return false;
+		}
+
+		auto sym{constant(args[0])};
+		auto check{
+			define
+				? emit_error(OPCODE::GLOBAL_FRESH,
+							 EvalError{Exception::REDEFINITION, token}, sym)
+				: emit_error(OPCODE::GLOBAL_BOUND,
+							 EvalError{Exception::UNDEFINED, args[0]},
+							 sym)};
+		form(args[1]);
+		emit(define ? OPCODE::DEFINE : OPCODE::SET, sym);
+		emit(OPCODE::NIL);
+		auto done{emit(OPCODE::JUMP)};
+
+		patch_b(check);
+		emit(OPCODE::FALLBACK, constant(token));
+		patch_a(done);
+		return true;
+	}
+	if (name == kDEFUN)
+	{
+		if (args.size() != 3)
+		{
+			emit_error(OPCODE::RAISE,
+					   EvalError{Exception::INVALID_NUMBER_OF_ARGS,
+								 L"defun takes 3 args", token});
+			return false;
+		}
+		if (args[0].type != TOKEN_TYPE::SYMBOL ||
+			args[1].type != TOKEN_TYPE::LIST || !all_symbols(args[1]) ||
+			args[2].type != TOKEN_TYPE::LIST)
+		{
+			emit_error(
+				OPCODE::RAISE,
+				EvalError{
+					Exception::INVALID_ARG_TYPES,
+					L"defun takes arg types: symbol list(symbols) list",
+					token});
+			return false;
+		}
+
+		auto sym{constant(args[0])};
+		auto check{emit_error(OPCODE::GLOBAL_FRESH,
+							  EvalError{Exception::REDEFINITION, token},
+							  sym)};
+		closure(&args[0], args[1], args[2]);
+		emit(OPCODE::DEFINE, sym);
+		emit(OPCODE::NIL);
+		auto done{emit(OPCODE::JUMP)};
+
+		patch_b(check);
+		emit(OPCODE::FALLBACK, constant(token));
+		patch_a(done);
+		return true;
+	}
+	if (name == kLAMBDA)
+	{
+		if (args.size() != 2)
+		{
+			emit_error(OPCODE::RAISE,
+					   EvalError{Exception::INVALID_NUMBER_OF_ARGS,
+								 L"lambda takes 2 args", token});
+			return false;
+		}
+		if (args[0].type != TOKEN_TYPE::LIST || !all_symbols(args[0]) ||
+			args[1].type != TOKEN_TYPE::LIST)
+		{
+			emit_error(OPCODE::RAISE,
+					   EvalError{Exception::INVALID_ARG_TYPES,
+								 L"lambda takes ar types: list(symbols) list",
+								 token});
+			return false;
+		}
+		closure(nullptr, args[0], args[1]);
+		return true;
+	}
+	// a load evaluates forms that aren't known until it runs
+	if (name == kLOAD)
+	{
+		emit(OPCODE::WALK, constant(token));
+		return true;
+	}
+	if (name == kFUNCALL)
+	{
+		if (args.empty())
+		{
+			emit_error(OPCODE::RAISE,
+					   EvalError{Exception::INVALID_NUMBER_OF_ARGS,
+								 L"funcall takes at least 1 arg", token});
+			emit(OPCODE::NIL);
+			return true;
+		}
+
+		// lambdas are called directly, anything else is handed back to
+		// the tree walker which knows how to dispatch on it
+		form(args.front());
+		auto dynamic{emit(OPCODE::FUNCALL)};
+		call(token, args.subspan(1));
+		auto done{emit(OPCODE::JUMP)};
+		patch_a(dynamic);
+		emit(OPCODE::DYNAMIC, constant(token));
+		patch_a(done);
+		return true;
+	}
+
+	return false;
+}
+}  // namespace
+
+std::shared_ptr<const chunk_t> Compile(const token_t &form, bool global)
+{
+	compiler_t compiler{.global_ = global};
+	compiler.form(form);
+	compiler.chunk_->code.push_back(instr_t{.op = OPCODE::RETURN});
+	return compiler.chunk_;
+}
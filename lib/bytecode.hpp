@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "interpreter.hpp"
+#include "structs.hpp"
+
+// The instructions understood by the bytecode VM, every instruction works on
+// the VM's value stack. a and b are operands, e is an index into the chunks
+// error prototypes
+enum class OPCODE : uint8_t
+{
+	// push an empty token
+	NIL,
+	// push constants[a]
+	CONST,
+	// push the value of the symbol constants[a]
+	LOAD,
+	// discard the top of the stack
+	POP,
+	// jump to a
+	JUMP,
+	// pop a bool, jump to a if its NIL
+	JUMP_UNLESS,
+	// jump to a if the folded bodies run as they were written
+	JUMP_UNFOLDED,
+	// if the top isn't a bool, pop it, raise e and jump to a
+	EXPECT_BOOL,
+	// raise e
+	RAISE,
+	// push the value bound to the symbol constants[a], jump to b if unbound
+	CALLEE,
+	// if the top isn't a lambda raise NOT_A_FUNCTION, replace it with an empty
+	// token and jump to a
+	EXPECT_FN,
+	// replace a symbol on the top with the lambda its bound to, if the top
+	// still isn't a lambda jump to a
+	FUNCALL,
+	// give the callee on the top a fresh activation frame
+	FRAME,
+	// if the callee on the top has less than a+1 arguments jump to b
+	ARG,
+	// pop a value and bind it to the callees a'th argument
+	BIND,
+	// pop the callee and evaluate its body in its activation frame, the call
+	// is constants[a]
+	CALL,
+	// pop b evaluated args and run the builtin named by the form constants[a]
+	BUILTIN,
+	// raise e and jump to b if the symbol constants[a] is defined globally
+	GLOBAL_FRESH,
+	// raise e and jump to b if the symbol constants[a] isn't defined globally
+	GLOBAL_BOUND,
+	// pop a value and define constants[a] with it globally
+	DEFINE,
+	// pop a value and assign it to the global constants[a]
+	SET,
+	// push a copy of the lambda constants[a] closed over the current env
+	CLOSURE,
+	// pop a head and tree walk it together with the raw args of constants[a]
+	DYNAMIC,
+	// tree walk constants[a]
+	WALK,
+	// tree walk the args of the form constants[a] and run the builtin its head
+	// names, what happens when a special form gives up half way
+	FALLBACK,
+	// leave the current chunk
+	RETURN,
+};
+
+struct instr_t
+{
+	OPCODE op;
+	uint16_t e{};
+	uint32_t a{};
+	uint32_t b{};
+};
+
+// Where a global symbol was found the last time it was looked up, good until
+// the globals change
+struct global_cache_t
+{
+	// the Interpreter::version_ it was looked up at
+	size_t version{};
+	token_t *value{};
+};
+
+// A compiled form, lambdas carry their own chunk for their body
+struct chunk_t
+{
+	std::vector<instr_t> code{};
+	std::vector<token_t> constants{};
+	std::vector<EvalError> errors{};
+	// one per constant, LOAD and CALLEE of a global symbol remember where it
+	// was found in the slot of their constant. Filled in as the chunk runs
+	mutable std::vector<global_cache_t> globals{};
+};
+
+/**
+ * @brief lowers a parsed form into bytecode for Interpreter::execute, the
+ *compiled code reports the same EvalErrors the tree walker would
+ * @param global whether the form runs in the global environment, symbols that
+ *aren't arguments of an enclosing lambda then go straight to the global table
+ **/
+std::shared_ptr<const chunk_t> Compile(const token_t &form, bool global);
@@ -0,0 +1,315 @@
+#include "heap.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "structs.hpp"
+
+struct heap_t
+{
+	std::mutex mutex_{};
+	// weak so watching an environment doesn't keep it alive
+	std::vector<std::weak_ptr<env_t>> young_envs_{};
+	// the heap holds a reference to the objects it watches, it drops it once
+	// its the only one left
+	std::vector<object_ptr_t> young_objects_{};
+	// the survivors, a collection takes the next ones from the back and puts
+	// the ones still alive back in front
+	std::deque<std::weak_ptr<env_t>> old_envs_{};
+	std::deque<object_ptr_t> old_objects_{};
+	size_t since_old_{};
+	heap_stats_t stats_{};
+};
+
+namespace
+{
+// the heap of the interpreter evaluating on this thread, see Heap::Scope
+thread_local Heap *current{};
+
+struct node_t
+{
+	// the references that come from the traced environments and objects
+	size_t internal{};
+	bool marked{};
+};
+
+// The references cleared out of the garbage, freed once the trace is done so
+// nothing is freed while its still being looked at
+struct grave_t
+{
+	std::vector<std::vector<token_t>> slots{};
+	std::vector<std::shared_ptr<env_t>> envs{};
+	std::vector<elements_t> elements{};
+};
+
+// The environments and objects one collection reaches from what it started
+// with
+class trace_t
+{
+public:
+	std::unordered_map<env_t *, node_t> envs_{};
+	std::unordered_map<object_t *, node_t> objects_{};
+	// every traced environment, held so none goes away mid trace
+	std::vector<std::shared_ptr<env_t>> held_{};
+
+	void add(const std::shared_ptr<env_t> &env) { count_env(env, false); }
+
+	// the heaps own reference to a watched object counts as one from inside
+	void add(const object_ptr_t &object)
+	{
+		auto [node, fresh]{objects_.try_emplace(object.get())};
+		node->second.internal++;
+		if (fresh)
+			scan_objects_.push_back(object.get());
+	}
+
+	// Counts the references the traced environments and objects hold to each
+	// other, finding the rest of them on the way
+	void count()
+	{
+		while (!scan_envs_.empty() || !scan_objects_.empty())
+		{
+			if (!scan_envs_.empty())
+			{
+				env_t *env{scan_envs_.back()};
+				scan_envs_.pop_back();
+				for (const token_t &i : env->slots_)
+					count_token(i, false);
+				count_env(env->next_env_, true);
+				continue;
+			}
+			object_t *object{scan_objects_.back()};
+			scan_objects_.pop_back();
+			for (const token_t &i : object->apval)
+				count_token(i, true);
+			count_env(object->env, true);
+		}
+	}
+
+	// Anything with more references than the trace accounts for is used from
+	// elsewhere, it and everything it reaches is alive
+	void mark()
+	{
+		for (auto &i : held_)
+			// less the one in held_
+			if (static_cast<size_t>(i.use_count()) - 1 >
+				envs_[i.get()].internal)
+				mark_env(i);
+		for (auto &[object, node] : objects_)
+			if (object->refs.load(std::memory_order_acquire) > node.internal)
+				mark_object(object);
+
+		while (!scan_envs_.empty() || !scan_objects_.empty())
+		{
+			if (!scan_envs_.empty())
+			{
+				env_t *env{scan_envs_.back()};
+				scan_envs_.pop_back();
+				for (const token_t &i : env->slots_)
+					mark_object(i.object.get());
+				mark_env(env->next_env_);
+				continue;
+			}
+			object_t *object{scan_objects_.back()};
+			scan_objects_.pop_back();
+			for (const token_t &i : object->apval)
+				mark_object(i.object.get());
+			mark_env(object->env);
+		}
+	}
+
+private:
+	std::vector<env_t *> scan_envs_{};
+	std::vector<object_t *> scan_objects_{};
+
+	// The global environment is the only one with named bindings, it lives as
+	// long as the program and is never traced
+	void count_env(const std::shared_ptr<env_t> &env, bool reference)
+	{
+		if (!env || env->curr_env_.size())
+			return;
+		auto [node, fresh]{envs_.try_emplace(env.get())};
+		node->second.internal += reference;
+		if (!fresh)
+			return;
+		held_.push_back(env);
+		scan_envs_.push_back(env.get());
+	}
+
+	// From an environment only lambdas are followed, a list bound in one is
+	// data and never looked into, so a trace doesn't walk big lists. The lists
+	// inside watched ones are followed, thats where they close their cycles
+	void count_token(const token_t &token, bool lists)
+	{
+		if (!token.object)
+			return;
+		auto node{objects_.find(token.object.get())};
+		if (node == objects_.end())
+		{
+			if (token.type != TOKEN_TYPE::LAMBDA &&
+				(!lists || token.type != TOKEN_TYPE::LIST))
+				return;
+			node = objects_.try_emplace(token.object.get()).first;
+			scan_objects_.push_back(token.object.get());
+		}
+		node->second.internal++;
+	}
+
+	void mark_env(const std::shared_ptr<env_t> &env)
+	{
+		if (auto node{envs_.find(env.get())};
+			node != envs_.end() && !node->second.marked)
+		{
+			node->second.marked = true;
+			scan_envs_.push_back(env.get());
+		}
+	}
+
+	void mark_object(object_t *object)
+	{
+		if (auto node{objects_.find(object)};
+			node != objects_.end() && !node->second.marked)
+		{
+			node->second.marked = true;
+			scan_objects_.push_back(object);
+		}
+	}
+};
+}  // namespace
+
+Heap::Heap() : heap_{std::make_unique<heap_t>()} {}
+
+Heap::~Heap() = default;
+
+Heap::Scope::Scope(Heap &heap) : prev_{std::exchange(current, &heap)} {}
+
+Heap::Scope::~Scope()
+{
+	current = prev_;
+}
+
+void Heap::track(const std::shared_ptr<env_t> &env)
+{
+	// made outside of any evaluation, nothing to collect it with
+	if (!current)
+		return;
+	auto &heap{*current->heap_};
+	std::lock_guard lock{heap.mutex_};
+	heap.young_envs_.push_back(env);
+}
+
+void Heap::track(const object_ptr_t &object)
+{
+	if (!current)
+		return;
+	auto &heap{*current->heap_};
+	std::lock_guard lock{heap.mutex_};
+	heap.young_objects_.push_back(object);
+}
+
+bool Heap::due()
+{
+	auto &heap{*heap_};
+	std::lock_guard lock{heap.mutex_};
+	if (heap.young_envs_.size() + heap.young_objects_.size() >= kYOUNG_LIMIT)
+		return true;
+	return ++heap.since_old_ >= kOLD_EVERY &&
+		   (heap.old_envs_.size() || heap.old_objects_.size());
+}
+
+void Heap::collect()
+{
+	const auto start{std::chrono::steady_clock::now()};
+	auto &heap{*heap_};
+	trace_t trace{};
+	grave_t grave{};
+	std::vector<std::weak_ptr<env_t>> envs{};
+	std::vector<object_ptr_t> objects{};
+
+	std::unique_lock lock{heap.mutex_};
+	heap.since_old_ = 0;
+
+	// the new ones first, whatever is left of the slice goes to the old ones
+	size_t budget{kSLICE};
+	auto take = [&budget](auto &from, auto &to)
+	{
+		for (; budget && !from.empty(); budget--)
+		{
+			to.push_back(std::move(from.back()));
+			from.pop_back();
+		}
+	};
+	take(heap.young_objects_, objects);
+	take(heap.young_envs_, envs);
+	take(heap.old_objects_, objects);
+	take(heap.old_envs_, envs);
+
+	// an object nothing else uses anymore is freed with the list
+	std::erase_if(objects, [](const object_ptr_t &i) { return i.unique(); });
+	for (auto &i : objects)
+		trace.add(i);
+	for (auto &i : envs)
+		if (auto env{i.lock()})
+			trace.add(env);
+	trace.count();
+	trace.mark();
+
+	// Break the cycles of whatever wasn't reached, the survivors get old
+	size_t freed_envs{};
+	size_t freed_objects{};
+	for (auto &i : trace.held_)
+	{
+		if (trace.envs_[i.get()].marked)
+			continue;
+		grave.slots.push_back(std::move(i->slots_));
+		grave.envs.push_back(std::move(i->next_env_));
+		freed_envs++;
+	}
+	for (auto &[object, node] : trace.objects_)
+	{
+		if (node.marked)
+			continue;
+		grave.elements.push_back(std::move(object->apval));
+		grave.envs.push_back(std::move(object->env));
+		freed_objects++;
+	}
+	for (auto &i : objects)
+		if (trace.objects_[i.get()].marked)
+			heap.old_objects_.push_front(std::move(i));
+	for (auto &i : envs)
+		if (auto env{i.lock()}; env && trace.envs_[env.get()].marked)
+			heap.old_envs_.push_front(std::move(i));
+
+	auto &stats{heap.stats_};
+	stats.collections++;
+	stats.freed_envs += freed_envs;
+	stats.freed_objects += freed_objects;
+	stats.envs = heap.old_envs_.size() + heap.young_envs_.size();
+	stats.objects = heap.old_objects_.size() + heap.young_objects_.size();
+	lock.unlock();
+
+	// freeing the garbage frees more environments and objects, none of which
+	// needs the heap
+	grave = {};
+	trace = {};
+	objects.clear();
+
+	lock.lock();
+	stats.last_pause = std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - start);
+	stats.max_pause = std::max(stats.max_pause, stats.last_pause);
+}
+
+heap_stats_t Heap::stats()
+{
+	auto &heap{*heap_};
+	std::lock_guard lock{heap.mutex_};
+	return heap.stats_;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+
+#include "structs.hpp"
+
+// What the cycle collector has done so far, see Heap
+struct heap_stats_t
+{
+	// the closure environments and lists being watched for cycles
+	size_t envs{};
+	size_t objects{};
+	size_t collections{};
+	// freed because only a cycle kept them alive
+	size_t freed_envs{};
+	size_t freed_objects{};
+	std::chrono::microseconds last_pause{};
+	std::chrono::microseconds max_pause{};
+};
+
+struct heap_t;
+
+// Reference counting frees everything that isn't part of a cycle, the heap
+// traces from what it watches to find the cycles. Whatever is only referenced
+// from the environments and objects the trace found, and can't be reached
+// from one that is referenced from elsewhere, is garbage and gets its
+// references cleared. Anything the trace doesn't look into counts as a
+// reference from elsewhere, so nothing still in use is ever freed.
+//
+// A cycle always runs through a closure or through a list make_cons wrote
+// into, so only those are watched. A collection traces from at most kSLICE of
+// them, the new ones first and then the next old ones in turn, which bounds
+// its pause. It has to run while nothing it watches is being evaluated.
+//
+// Every interpreter has a heap of its own, whatever is made while it
+// evaluates is watched by its heap. Values shouldn't be shared between
+// interpreters evaluating at the same time
+class Heap
+{
+public:
+	// how many new ones make a collection due
+	static constexpr size_t kYOUNG_LIMIT{4096};
+	// how many a collection starts tracing from
+	static constexpr size_t kSLICE{4096};
+	// how many forms can be evaluated before the old ones are due a look,
+	// even when nothing new is watched
+	static constexpr size_t kOLD_EVERY{64};
+
+	Heap();
+	~Heap();
+
+	Heap(const Heap &) = delete;
+	void operator=(const Heap &) = delete;
+
+	// Makes heap the one this thread watches with, until the scope ends
+	class Scope
+	{
+	public:
+		explicit Scope(Heap &heap);
+		~Scope();
+
+		Scope(const Scope &) = delete;
+		void operator=(const Scope &) = delete;
+
+	private:
+		Heap *prev_;
+	};
+
+	// the environment a closure was made with
+	static void track(const std::shared_ptr<env_t> &env);
+	// a list make_cons wrote a list or a lambda into, the only way a list can
+	// end up containing itself
+	static void track(const object_ptr_t &object);
+
+	// whether a collection is due, called once for every evaluated form
+	bool due();
+
+	void collect();
+
+	heap_stats_t stats();
+
+private:
+	std::unique_ptr<heap_t> heap_;
+};
@@ -1,843 +1,2149 @@
 #include "interpreter.hpp"
 
+#include <pthread.h>
+
 #include <algorithm>
 #include <cassert>
 #include <climits>
+#include <limits>
 #include <cmath>
+#include <format>
+#include <fstream>
 #include <memory>
 #include <numeric>
 #include <ranges>
 
+#include "bytecode.hpp"
+#include "heap.hpp"
+#include "parser.hpp"
 #include "structs.hpp"
 
-std::vector<EvalError> Interpreter::err_{};
-std::shared_ptr<env_t> Interpreter::env_{
-	std::make_shared<env_t>(env_t{.env_name_{L"global"}})};
-
-// singleton stuff
-Interpreter* Interpreter::pinstance_{nullptr};
-std::mutex Interpreter::mutex_;
-
-Interpreter* Interpreter::getInstance()
+namespace
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+// The names of the builtins, interned up front so finding one is an integer
+// compare
+const symbol_t kPRINT{SymbolTable::intern(L"print")};
+const symbol_t kMAPCAR{SymbolTable::intern(L"mapcar")};
+const symbol_t kPMAPCAR{SymbolTable::intern(L"pmapcar")};
+const symbol_t kPFILTER{SymbolTable::intern(L"pfilter")};
+const symbol_t kPREDUCE{SymbolTable::intern(L"preduce")};
+const symbol_t kCAR{SymbolTable::intern(L"car")};
+const symbol_t kCDR{SymbolTable::intern(L"cdr")};
+const symbol_t kCONS{SymbolTable::intern(L"cons")};
+const symbol_t kSQRT{SymbolTable::intern(L"sqrt")};
+const symbol_t kPOW{SymbolTable::intern(L"pow")};
+const symbol_t kADD{SymbolTable::intern(L"+")};
+const symbol_t kSUB{SymbolTable::intern(L"-")};
+const symbol_t kMUL{SymbolTable::intern(L"*")};
+const symbol_t kDIV{SymbolTable::intern(L"/")};
+const symbol_t kEQ{SymbolTable::intern(L"==")};
+const symbol_t kNE{SymbolTable::intern(L"!=")};
+const symbol_t kGE{SymbolTable::intern(L">=")};
+const symbol_t kGT{SymbolTable::intern(L">")};
+const symbol_t kLE{SymbolTable::intern(L"<=")};
+const symbol_t kLT{SymbolTable::intern(L"<")};
+const symbol_t kAND{SymbolTable::intern(L"and")};
+const symbol_t kOR{SymbolTable::intern(L"or")};
+const symbol_t kNOT{SymbolTable::intern(L"not")};
 
-	if (pinstance_ == nullptr)
-		pinstance_ = new Interpreter();
+// The calls mapcar makes, the function in args[0] applied to the i'th element
+// of every list after it, as many as the shortest list has elements
+std::vector<token_t> MapCalls(std::span<const token_t> args)
+{
+	auto lists{args.subspan(1)};
+	const size_t shortest{
+		std::ranges::min(lists | std::ranges::views::transform(
+									 [](const token_t& i)
+									 { return i.apval().size(); }))};
 
-	return pinstance_;
+	// effectively a transposed join, with the function in front
+	std::vector<token_t> calls{};
+	calls.reserve(shortest);
+	for (size_t i{0}; i < shortest; i++)
+	{
+		elements_t call{args[0]};
+		for (const token_t& j : lists)
+			call.push_back(j.apval()[i]);
+		calls.push_back(token_t::make_list(std::move(call)));
+	}
+	return calls;
 }
 
-token_t Interpreter::eval(const token_t& token, std::weak_ptr<env_t> env)
+// How much of the native stack the tree walker leaves for what runs between
+// two of its depth checks, a builtin and reporting the error
+constexpr size_t kSTACK_RESERVE{256 * 1024};
+
+// lists shorter than this aren't worth handing to the pool
+constexpr size_t kMIN_PARALLEL{32};
+// how many chunks preduce splits a list into for every worker
+constexpr size_t kCHUNKS_PER_WORKER{4};
+
+// Looks through a function for anything that does more than compute a value.
+// A callee it can't see through, like an argument or a symbol that isn't
+// bound globally, might do anything so it counts as impure
+class purity_t
 {
-	if (token.quoted)
+public:
+	explicit purity_t(env_t& global) : global_{global} {}
+
+	// fn is a value a builtin was called with, a lambda or a builtins name
+	bool function(const token_t& fn)
 	{
-		auto tmp{token};
-		tmp.quoted = false;
-		return tmp;
+		if (fn.type == TOKEN_TYPE::SYMBOL)
+			return callee(fn);
+		// calling anything else only raises an error
+		if (fn.type != TOKEN_TYPE::LAMBDA)
+			return true;
+		// recursion, its pure unless the rest of it isn't
+		if (std::ranges::find(seen_, fn.object.get()) != seen_.end())
+		{
+			// the function looked at first is still being looked at
+			recursive_ |= fn.object.get() == seen_.front();
+			return true;
+		}
+		seen_.push_back(fn.object.get());
+		scopes_.push_back({.params{}, .env = fn.env().get()});
+		const bool ret{form(*fn.expr())};
+		scopes_.pop_back();
+		return ret;
 	}
 
-	switch (token.type)
+	// whether the first function function was called with can call itself
+	bool recursive() const
 	{
-	case TOKEN_TYPE::SYMBOL:
+		return recursive_;
+	}
+
+private:
+	// what a symbol in the form being looked at can be bound to, the
+	// arguments of a lambda form or the environment a function was made in
+	struct scope_t
 	{
-		// This little section is for error checking on if the envrionment
-		// contained the value or not
-		return env.lock()
-			->find(token)
-			// returns the value if it exists, or a blank optional
-			.or_else(
-				[&token, &env]()
-				{
-					err_.emplace_back(
-						EvalError::Exception::UNDEFINED, token, env.lock());
-					return std::optional<token_t>{};
-				})
-			// If we found the value we return it, otherwise we
-			// return a default value
-			.value_or(token_t{});
-	}
-	case TOKEN_TYPE::INT:
-	case TOKEN_TYPE::BOOL:
-		return token;
-	case TOKEN_TYPE::LIST:
+		std::span<const token_t> params;
+		const env_t* env;
+	};
+
+	env_t& global_;
+	std::vector<const object_t*> seen_{};
+	std::vector<scope_t> scopes_{};
+	bool recursive_{};
+
+	// whether name is bound anywhere but the global environment. Bodies the
+	// bytecode engine compiled, and lambda forms, aren't resolved so their
+	// arguments are only known by name
+	bool local(symbol_t name) const
 	{
-		if (token.apval.empty())
+		for (size_t i{scopes_.size()}; i > 0; i--)
 		{
-			err_.emplace_back(EvalError::Exception::EVAL_EMPTY_LIST, token);
-			return {};
+			const scope_t& scope{scopes_[i - 1]};
+			if (std::ranges::any_of(scope.params, [name](const token_t& j)
+									{ return j.pname == name; }))
+				return true;
+			if (!scope.env)
+				continue;
+			// a function only sees where it was made, not its callers
+			for (const env_t* env{scope.env}; env && env != &global_;
+				 env = env->next_env_.get())
+				if (env->slot_of(name) || env->curr_env_.contains(name))
+					return true;
+			return false;
 		}
+		return false;
+	}
 
-		auto func{token.apval.front()};
+	bool callee(const token_t& symbol)
+	{
+		if (symbol.scope == SCOPE::LEXICAL ||
+			(symbol.scope == SCOPE::DYNAMIC && local(symbol.pname)))
+			return false;
+		// a user binding wins over the builtins
+		if (auto value{global_.curr_env_.find(symbol.pname)})
+			return function(*value);
+		if (!Interpreter::find_builtin(symbol.pname))
+			return false;
+		// cons evaluates its first argument again, that can be any form
+		const symbol_t name{symbol.pname};
+		return name != kDEFINE && name != kSET && name != kDEFUN &&
+			   name != kLOAD && name != kQUIT && name != kPRINT &&
+			   name != kCONS;
+	}
 
-		switch (func.type)
-		{
-		case TOKEN_TYPE::SYMBOL:
-		{
-			if (!env.lock()->find(func).has_value())
-			{
-				return default_functions(
-						   token, func,
-						   token.apval | std::ranges::views::drop(1), env)
-					.or_else(
-						[&env, &func]() -> std::optional<token_t>
-						{
-							err_.emplace_back(EvalError::Exception::UNDEFINED,
-											  func, env.lock());
-							return {};
-						})
-					.value_or(token_t{});
-			}
-			func = env.lock()->find(func).value();
+	// whether the builtin called name calls its first argument
+	bool calls_first(symbol_t name)
+	{
+		return !global_.curr_env_.contains(name) &&
+			   (name == kFUNCALL || name == kMAPCAR || name == kPMAPCAR ||
+				name == kPFILTER || name == kPREDUCE);
+	}
 
-			if (func.type != TOKEN_TYPE::LAMBDA)
-			{
-				err_.emplace_back(EvalError::Exception::NOT_A_FUNCTION, func);
-				return {};
-			}
-		}
-			[[fallthrough]];
-		case TOKEN_TYPE::LAMBDA:
+	bool form(const token_t& token)
+	{
+		if (token.quoted || token.type != TOKEN_TYPE::LIST ||
+			token.apval().empty())
+			return true;
+
+		const auto items{token.apval()};
+		const token_t& head{items.front()};
+		if (head.type == TOKEN_TYPE::SYMBOL)
 		{
-			// This takes the args in the list and applies them
-			// to the lambdas args
-			for (auto i : std::ranges::views::zip(
-					 func.apval, token.apval | std::ranges::views::drop(1)))
+			// only the body, the arguments aren't evaluated
+			if (head.pname == kLAMBDA &&
+				!global_.curr_env_.contains(head.pname))
 			{
-				// put the args into the functions defined envrionment
-				func.env->curr_env_.insert_or_assign(
-					*i.first.pname, eval(i.second, env));
+				if (items.size() < 3)
+					return true;
+				scopes_.push_back({.params{items[1].apval()}, .env{}});
+				const bool ret{form(items[2])};
+				scopes_.pop_back();
+				return ret;
 			}
-
-			// evaluate the expression body within the given
-			// envrionment
-			return eval(*func.expr, func.env);
-		}
-		default:
-			err_.emplace_back(EvalError::Exception::NOT_A_FUNCTION, func);
-			return {};
+			if (!callee(head))
+				return false;
+			// the function has to be one thats visible from here
+			if (calls_first(head.pname) && items.size() > 1 &&
+				!(items[1].type == TOKEN_TYPE::SYMBOL
+					  ? callee(items[1])
+					  : IsLambdaForm(items[1])))
+				return false;
 		}
-		return {};
-	}
-	case TOKEN_TYPE::LAMBDA:
-	case TOKEN_TYPE::DELIM:
-		// This should never be reached.
-		err_.emplace_back(EvalError::Exception::NOTREACHABLE, token);
-		return {};
+		// only a lambda made right there can be seen through
+		else if (!IsLambdaForm(head))
+			return false;
+
+		return std::ranges::all_of(items, [this](const token_t& i)
+								   { return form(i); });
 	}
 
-	return token;
+	static bool IsLambdaForm(const token_t& token)
+	{
+		return token.type == TOKEN_TYPE::LIST && !token.quoted &&
+			   !token.apval().empty() &&
+			   token.apval().front().type == TOKEN_TYPE::SYMBOL &&
+			   token.apval().front().pname == kLAMBDA;
+	}
 };
 
-std::optional<token_t> Interpreter::default_functions(
-	const token_t& token,
-	const token_t& func,
-	std::span<const token_t> raw_args,
-	std::weak_ptr<env_t> env)
+// The value a constant evaluates to, nothing if the token isn't one
+std::optional<token_t> ConstantValue(const token_t& token)
 {
-	assert(func.type == TOKEN_TYPE::SYMBOL);
+	if (token.quoted)
+	{
+		token_t ret{token};
+		ret.quoted = false;
+		return ret;
+	}
+	if (token.type == TOKEN_TYPE::INT || token.type == TOKEN_TYPE::BOOL)
+		return token;
+	return {};
+}
 
-	// Runs special functions that modify the environment
-	auto ret{special_functions(token, func, raw_args, env)};
-	if (ret.has_value())
-		return ret.value();
+// A constant that evaluates to value
+token_t Literal(token_t value)
+{
+	value.quoted =
+		value.type != TOKEN_TYPE::INT && value.type != TOKEN_TYPE::BOOL;
+	return value;
+}
 
-	// for the rest of these the args are evaluated
-	auto argsv =
-		raw_args |
-		std::ranges::views::transform(
-			[this, env](const token_t& t) -> token_t { return eval(t, env); });
-	std::vector<token_t> args{argsv.begin(), argsv.end()};
+// pow with a bigger exponent is left to run time, folding it could take a
+// while for a branch that never runs
+constexpr int64_t kMAX_FOLDED_EXP{64};
 
-	if (!func.pname->compare(L"print"))
+// The value of an INT, big or not
+BigInt ToBig(const token_t& token)
+{
+	return token.big() ? *token.big() : BigInt{token.val};
+}
+
+bool AllInts(std::span<const token_t> args)
+{
+	return std::ranges::all_of(
+		args, [](const token_t& i) { return i.type == TOKEN_TYPE::INT; });
+}
+
+// Folds rest into first, with fixnum while everything fits in an int64_t and
+// with big from the first big int or overflow on. fixnum returns whether the
+// result overflowed, like the __builtin_*_overflow functions do
+template <typename Fixnum, typename Big>
+token_t FoldInts(const token_t& first,
+				 std::span<const token_t> rest,
+				 Fixnum fixnum,
+				 Big big)
+{
+	int64_t total{first.val};
+	size_t i{0};
+	if (!first.big())
 	{
-		if (args.size() != 1)
+		for (int64_t res; i < rest.size() && !rest[i].big(); i++)
 		{
-			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
-							  L"print takes 1 arg", token);
-			return token_t{};
+			if (fixnum(total, rest[i].val, &res))
+				break;
+			total = res;
 		}
+		if (i == rest.size())
+			return token_t{.val = total, .type = TOKEN_TYPE::INT};
+	}
 
-		args[0].quoted = true;
+	BigInt ret{first.big() ? *first.big() : BigInt{total}};
+	for (; i < rest.size(); i++)
+		ret = big(ret, ToBig(rest[i]));
+	return token_t::make_int(std::move(ret));
+}
 
-		return eval(args[0], env);
-	}
-	if (!func.pname->compare(L"mapcar"))
+// base to the power of exp by squaring, nothing if it doesn't fit
+std::optional<int64_t> PowFixnum(int64_t base, uint64_t exp)
+{
+	int64_t ret{1};
+	while (exp)
 	{
-		// mapcar takes at least 2 args, mapcar func args args args ...
-		if (args.size() < 2)
-		{
-			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
-							  L"mapcar takes 2 or more args", token);
+		if (exp & 1 && __builtin_mul_overflow(ret, base, &ret))
 			return {};
-		}
-		else if ((args[0].type != TOKEN_TYPE::SYMBOL &&
-				  args[0].type != TOKEN_TYPE::LAMBDA) ||
-				 // The rest of the arguments are a list
-				 [args]()
-				 {
-					 // for each argument in the args (thats not the function)
-					 for (const token_t& i : args | std::ranges::views::drop(1))
-						 if (i.type != TOKEN_TYPE::LIST)
-							 return true;
-					 return false;
-				 }())
-		{
-			err_.emplace_back(
-				EvalError::Exception::INVALID_ARG_TYPES,
-				L"mapcar takes arg types: lamba/symbol list list ...", token);
-			return token_t{};
-		}
+		exp >>= 1;
+		if (exp && __builtin_mul_overflow(base, base, &base))
+			return {};
+	}
+	return ret;
+}
 
-		// behold this functional bullshit
-		auto actual_args = args | std::ranges::views::drop(1);
-		std::vector<token_t> results{};
+// The largest integer whose square is at most n, the double estimate is off
+// by at most one either way
+uint64_t ISqrt(uint64_t n)
+{
+	uint64_t ret{static_cast<uint64_t>(std::sqrt(static_cast<double>(n)))};
+	while (ret * ret > n)
+		ret--;
+	while ((ret + 1) * (ret + 1) <= n)
+		ret++;
+	return ret;
+}
+}  // namespace
 
-		// shortest of the argument lists
-		size_t shortest_list_size{
-			std::ranges::min_element(
-				actual_args, [](token_t& a, token_t& b)
-				{ return a.apval.size() < b.apval.size(); })
-				->apval.size()};
+Interpreter::Interpreter()
+	: env_{std::make_shared<env_t>(env_t{.env_name_{L"global"}})}
+{
+}
 
-		// effectively a transposed join
-		// then throw the function in front and eval that hoe
-		for (size_t i{0}; i < shortest_list_size; i++)
-		{
-			token_t eval_token{.type = TOKEN_TYPE::LIST};
+Interpreter::Interpreter(Interpreter* parent)
+	: env_{parent->env_},
+	  engine_{parent->engine_},
+	  max_depth_{parent->max_depth_},
+	  memo_{parent->memo_.capacity()},
+	  parent_{parent}
+{
+}
 
-			auto arg_list =
-				actual_args |
-				std::ranges::views::transform(
-					[&i](token_t& t) -> token_t& { return t.apval[i]; });
+Interpreter* Interpreter::getInstance()
+{
+	// never freed, like the symbols it may still use at exit
+	static Interpreter* instance{new Interpreter()};
+	return instance;
+}
 
-			// put the args into the list
-			eval_token.apval.assign(arg_list.begin(), arg_list.end());
-			//
-			// put the function at the beginning of the list
-			eval_token.apval.insert(eval_token.apval.begin(), args[0]);
+token_t Interpreter::eval(const token_t& token, std::weak_ptr<env_t> env)
+{
+	if (too_deep(token))
+	{
+		err_.emplace_back(EvalError::Exception::MAX_DEPTH, token);
+		return {};
+	}
 
-			results.push_back(eval(eval_token, env));
-		}
+	// whatever is made while evaluating is watched by this interpreters heap
+	Heap::Scope heap_scope{heap_};
 
-		return token_t{.type = TOKEN_TYPE::LIST, .apval{std::move(results)}};
-	}
-	else if (!func.pname->compare(L"car"))
+	// the lambda and defun bodies are folded once here, instead of every time
+	// they run. Only at the top, a local binding could shadow a builtin
+	const bool global{env.lock() == env_};
+	std::optional<token_t> folded{};
+	if (global && !unfolded_)
 	{
-		if (args.size() != 1)
-		{
-			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
-							  L"car takes 1 arg", token);
-			return token_t{};
-		}
-		else if (args[0].type != TOKEN_TYPE::LIST)
-		{
-			err_.emplace_back(EvalError::Exception::INVALID_ARG_TYPES,
-							  L"car takes arg types: list", token);
-			return token_t{};
-		}
-		return args[0].apval.front();
+		std::vector<std::span<const token_t>> scopes{};
+		folded = fold(token, scopes);
 	}
-	else if (!func.pname->compare(L"cdr"))
+	const token_t& form{folded.has_value() ? *folded : token};
+
+	token_t ret{};
+	switch (engine_)
 	{
-		if (args.size() != 1)
-		{
-			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
-							  L"cdr takes 1 arg", token);
-			return token_t{};
-		}
-		else if (args[0].type != TOKEN_TYPE::LIST)
-		{
-			err_.emplace_back(EvalError::Exception::INVALID_ARG_TYPES,
-							  L"cdr takes arg types: list", token);
-			return token_t{};
-		}
-		auto ret{args[0]};
-		ret.apval.erase(ret.apval.begin());
-		return ret;
+	case ENGINE::BYTECODE:
+		ret = execute(*Compile(form, global), env.lock());
+		break;
+	case ENGINE::TREE:
+		ret = walk(form, env);
+		break;
 	}
-	else if (!func.pname->compare(L"cons"))
-	{
-		if (args.size() != 2)
-		{
-			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
-							  L"cons takes 2 args", token);
-			return token_t{};
-		}
-		else if (args[1].type != TOKEN_TYPE::LIST)
-		{
-			err_.emplace_back(EvalError::Exception::INVALID_ARG_TYPES,
-							  L"cons takes arg types: any list", token);
-			return token_t{};
-		}
 
-		token_t ret{args[1]};
-		ret.apval.insert(ret.apval.begin(), eval(args[0], env));
+	// between two forms nothing is being evaluated, a safe point to look for
+	// cycles. Not so for the forms a load in the middle of a form evaluates
+	if (!depth_ && heap_.due())
+		heap_.collect();
 
-		return ret;
+	// whatever was raised while unwinding from the depth limit is noise
+	if (aborted_)
+	{
+		while (err_.size() > abort_at_)
+			err_.pop_back();
+		aborted_ = false;
+		blame_call_ = false;
+		return {};
 	}
-	else if (!func.pname->compare(L"sqrt"))
+	return ret;
+}
+
+token_t Interpreter::load(std::istream& in, std::weak_ptr<env_t> env)
+{
+	const size_t errors{err_.size()};
+	FormReader reader{in};
+	token_t ret{};
+	while (auto form{reader.next()})
 	{
-		if (args.size() != 1)
+		// every form gets an arena of its own, its freed with the last of
+		// the forms lists
+		auto [tokens, parse_err]{ParseEvalTokens(*form, true)};
+		if (parse_err.err != ParserError::Exception::NONE)
 		{
-			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
-							  L"sqrt takes 1 arg", token);
-			return token_t{};
+			err_.emplace_back(EvalError::Exception::LOAD,
+							  std::format(L"line {}: {}",
+										  reader.line(),
+										  parse_err.what()),
+							  token_t{});
+			return {};
 		}
-		if (args[0].type != TOKEN_TYPE::INT)
+		for (const token_t& i : tokens)
 		{
-			err_.emplace_back(EvalError::Exception::INVALID_ARG_TYPES,
-							  L"sqrt takes arg types: int", token);
-			return token_t{};
+			ret = eval(i, env);
+			if (err_.size() > errors)
+				return {};
 		}
+	}
+	return ret;
+}
 
-		return token_t{
-			.val = static_cast<int>(sqrt(args[0].val)),
-			.type = TOKEN_TYPE::INT,
-		};
+token_t Interpreter::load(const std::filesystem::path& path,
+						  std::weak_ptr<env_t> env)
+{
+	std::ifstream file{path, std::ios_base::in | std::ios_base::binary};
+	if (!file)
+	{
+		err_.emplace_back(EvalError::Exception::LOAD,
+						  std::format(L"Couldn't open {}", path.wstring()),
+						  token_t{});
+		return {};
 	}
-	else if (!func.pname->compare(L"pow"))
+	return load(file, env);
+}
+
+void Interpreter::exceed_depth(const token_t& token)
+{
+	err_.emplace_back(EvalError::Exception::MAX_DEPTH, token);
+	aborted_ = true;
+	abort_at_ = err_.size();
+}
+
+bool Interpreter::stack_exhausted()
+{
+	// worked out once for every thread, nullptr when the stack can't be
+	// found and the depth limit is all there is
+	static thread_local const char* const kLIMIT{[]() -> const char*
 	{
-		if (args.size() != 2)
-		{
-			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
-							  L"exp takes 2 args", token);
-			return token_t{};
-		}
-		if (args[0].type != TOKEN_TYPE::INT || args[1].type != TOKEN_TYPE::INT)
-		{
-			err_.emplace_back(EvalError::Exception::INVALID_ARG_TYPES,
-							  L"exp takes arg types: int int", token);
-			return token_t{};
-		}
-		int res = std::pow(args[0].val, args[1].val);
-		if (res == INT_MAX || res != INT_MAX)
-			err_.emplace_back(EvalError::Exception::OVERFLOW, token);
+		pthread_attr_t attr;
+		if (pthread_getattr_np(pthread_self(), &attr))
+			return nullptr;
+		void* low{};
+		size_t size{};
+		const bool found{!pthread_attr_getstack(&attr, &low, &size)};
+		pthread_attr_destroy(&attr);
+		if (!found || size <= 2 * kSTACK_RESERVE)
+			return nullptr;
+		// the stack grows down towards low
+		return static_cast<const char*>(low) + kSTACK_RESERVE;
+	}()};
+	const char* here{static_cast<const char*>(__builtin_frame_address(0))};
+	return kLIMIT && here < kLIMIT;
+}
 
-		return token_t{
-			.val = res,
-			.type = TOKEN_TYPE::INT,
-		};
+bool Interpreter::too_deep(const token_t& form) const
+{
+	// the lists still to look into and how deep they are
+	std::vector<std::pair<const token_t*, size_t>> lists{{&form, 1}};
+	while (!lists.empty())
+	{
+		auto [list, depth]{lists.back()};
+		lists.pop_back();
+		if (depth > std::min(max_depth_, kMAX_NESTING))
+			return true;
+		for (const token_t& i : list->apval())
+			if (i.type == TOKEN_TYPE::LIST)
+				lists.emplace_back(&i, depth + 1);
 	}
-	else if (!func.pname->compare(L"+"))
-		return token_t{
-			.val = std::accumulate(
-				args.begin(), args.end(), 0,
-				[&token](int total, token_t& x)
-				{
-					if (x.type != TOKEN_TYPE::INT)
-						err_.emplace_back(
-							EvalError::Exception::MATH_ERR, token);
-					int res;
-					if (__builtin_add_overflow(total, x.val, &res))
-						err_.emplace_back(
-							EvalError::Exception::OVERFLOW, token);
-					return res;
-				}),
-			.type = TOKEN_TYPE::INT,
-		};
-	else if (!func.pname->compare(L"-"))
-		return token_t{
-			.val = std::accumulate(
-				std::next(args.begin()), args.end(), args.begin()->val,
-				[&token](int total, token_t& x)
-				{
-					if (x.type != TOKEN_TYPE::INT)
-						err_.emplace_back(
-							EvalError::Exception::MATH_ERR, token);
-					int res;
-					if (__builtin_sub_overflow(total, x.val, &res))
-						err_.emplace_back(
-							EvalError::Exception::OVERFLOW, token);
-					return res;
-				}),
-			.type = TOKEN_TYPE::INT,
-		};
-	else if (!func.pname->compare(L"*"))
-		return token_t{
-			.val = std::accumulate(
-				args.begin(), args.end(), 1,
-				[&token](int total, token_t& x)
-				{
-					if (x.type != TOKEN_TYPE::INT)
-						err_.emplace_back(
-							EvalError::Exception::MATH_ERR, token);
-
-					int res;
-					if (__builtin_mul_overflow(total, x.val, &res))
-						err_.emplace_back(
-							EvalError::Exception::OVERFLOW, token);
-					return res;
-				}),
-			.type = TOKEN_TYPE::INT,
-		};
-	else if (!func.pname->compare(L"/"))
-		return token_t{
-			.val = std::accumulate(
-				std::next(args.begin()), args.end(), args.begin()->val,
-				[&token](int total, token_t& x)
-				{
-					if (x.type != TOKEN_TYPE::INT)
-						err_.emplace_back(
-							EvalError::Exception::MATH_ERR, token);
-					if (x.val == 0)
-					{
-						err_.emplace_back(
-							EvalError::Exception::DIVIDE_BY_ZERO, x);
-						return 0;
-					}
-					return total / x.val;
-				}),
-			.type = TOKEN_TYPE::INT,
-		};
-	else if (!func.pname->compare(L"=="))
+	return false;
+}
+
+token_t Interpreter::walk(const token_t& form, std::weak_ptr<env_t> env)
+{
+	// Calls in tail position replace the expression being walked instead of
+	// recursing into walk, so a tail recursive loop runs in constant stack.
+	// owner keeps the current expression alive once its a lambda body or a
+	// list funcall built
+	const token_t* expr{&form};
+	std::shared_ptr<const token_t> owner{};
+	// the call the current expression was made for by funcall
+	std::optional<token_t> made_for{};
+	// whether no lambda was called yet, its result is what this walk returns.
+	// A memoized body is walked in place of the call, a call its in tail
+	// position of isn't the first
+	bool first_call{!std::exchange(body_walk_, false)};
+
+	// the activation frame of the lambda whose body is being walked, handed
+	// back to the pool on the way out
+	std::shared_ptr<env_t> frame{};
+	struct walk_guard_t
 	{
-		if (args.size() < 2)
+		Interpreter* interp;
+		std::shared_ptr<env_t>& frame;
+		size_t depth;
+		// the call whose body is being walked
+		std::optional<token_t> call{};
+		~walk_guard_t()
 		{
-			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
-							  L"= takes 2 or more args", token);
-			return token_t{};
-		}
-		return token_t{
-			.is_true =
-				[&args, token]()
+			interp->depth_ = depth;
+			// running out of depth is put down to the innermost call whose
+			// body couldn't go on, the call the bytecode engine reports
+			if (interp->blame_call_ && call.has_value())
 			{
-				for (size_t i{0}; i < args.size() - 1; i++)
-					if (args[i] != args[i + 1])
-						return false;
-				return true;
-			}(),
-			.type = TOKEN_TYPE::BOOL,
-		};
-	}
-	else if (!func.pname->compare(L"!="))
+				interp->err_[interp->abort_at_ - 1].token_ =
+					std::move(call).value();
+				interp->blame_call_ = false;
+			}
+			if (frame)
+				interp->release_frame(std::move(frame));
+		}
+	} guard{this, frame, depth_++};
+	peak_ = std::max(peak_, depth_);
+
+	if (depth_ > max_depth_ || stack_exhausted())
 	{
-		if (args.size() < 2)
+		if (!aborted_)
 		{
-			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
-							  L"= takes 2 or more args", token);
-			return token_t{};
+			exceed_depth(form);
+			blame_call_ = true;
 		}
-		return token_t{
-			.is_true =
-				[&args, token]()
-			{
-				for (size_t i{0}; i < args.size() - 1; i++)
-					if (args[i] == args[i + 1])
-						return false;
-				return true;
-			}(),
-			.type = TOKEN_TYPE::BOOL,
-		};
+		return {};
 	}
-	else if (!func.pname->compare(L">="))
+
+	while (true)
 	{
-		if (args.size() < 2)
+		if (aborted_)
+			return {};
+
+		const token_t& token{*expr};
+
+		if (token.quoted)
 		{
-			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
-							  L"> takes 2 or more args", token);
-			return token_t{};
+			auto tmp{token};
+			tmp.quoted = false;
+			return tmp;
 		}
-		return token_t{
-			.is_true =
-				[&args, &token]()
-			{
-				for (size_t i{0}; i < args.size() - 1; i++)
-				{
-					if (args[i].type != TOKEN_TYPE::INT &&
-						args[i + 1].type != TOKEN_TYPE::INT)
-					{
-						err_.emplace_back(
-							EvalError::Exception::INVALID_ARG_TYPES,
-							L"> takes arg types: int int int...", token);
-						return false;
-					}
-					if (args[i] < args[i + 1])
-						return false;
-				}
-				return true;
-			}(),
-			.type = TOKEN_TYPE::BOOL,
-		};
-	}
-	else if (!func.pname->compare(L">"))
-	{
-		if (args.size() < 2)
+
+		switch (token.type)
 		{
-			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
-							  L"> takes 2 or more args", token);
-			return token_t{};
+		case TOKEN_TYPE::SYMBOL:
+		{
+			if (const token_t* value{lookup(token, env)})
+				return *value;
+			err_.emplace_back(
+				EvalError::Exception::UNDEFINED, token, env.lock());
+			return {};
 		}
-		return token_t{
-			.is_true =
-				[&args, &token]()
+		case TOKEN_TYPE::INT:
+		case TOKEN_TYPE::BOOL:
+			return token;
+		case TOKEN_TYPE::LIST:
+		{
+			if (token.apval().empty())
 			{
-				for (size_t i{0}; i < args.size() - 1; i++)
+				err_.emplace_back(EvalError::Exception::EVAL_EMPTY_LIST, token);
+				return {};
+			}
+
+			auto func{token.apval().front()};
+
+			switch (func.type)
+			{
+			case TOKEN_TYPE::SYMBOL:
+			{
+				// a user binding always wins over a builtin. A folded body's
+				// head can't be bound
+				const token_t* bound{
+					func.pname == kFOLDED ? nullptr : lookup(func, env)};
+				if (!bound)
 				{
-					if (args[i].type != TOKEN_TYPE::INT &&
-						args[i + 1].type != TOKEN_TYPE::INT)
+					auto ret{default_functions(
+						token, func, find_builtin(func.pname),
+						token.apval() | std::ranges::views::drop(1), env)};
+
+					// the special form left its tail call to us
+					if (tail_.has_value())
 					{
-						err_.emplace_back(
-							EvalError::Exception::INVALID_ARG_TYPES,
-							L"> takes arg types: int int int...", token);
-						return false;
+						auto tail{std::move(tail_).value()};
+						tail_.reset();
+						if (tail.owner)
+							owner = std::move(tail.owner);
+						expr = tail.expr;
+						made_for = std::move(tail.call);
+						continue;
 					}
-					if (args[i] <= args[i + 1])
-						return false;
+
+					return std::move(ret)
+						.or_else(
+							[this, &env, &func]() -> std::optional<token_t>
+							{
+								err_.emplace_back(
+									EvalError::Exception::UNDEFINED, func,
+									env.lock());
+								return {};
+							})
+						.value_or(token_t{});
 				}
-				return true;
-			}(),
-			.type = TOKEN_TYPE::BOOL,
-		};
-	}
-	else if (!func.pname->compare(L"<="))
-	{
-		if (args.size() < 2)
-		{
-			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
-							  L"< takes 2 or more args", token);
-			return token_t{};
-		}
-		return token_t{
-			.is_true =
-				[&args, &token]()
-			{
-				for (size_t i{0}; i < args.size() - 1; i++)
+				// copied, walking the arguments can define over the binding
+				func = *bound;
+
+				if (func.type != TOKEN_TYPE::LAMBDA)
 				{
-					if (args[i].type != TOKEN_TYPE::INT &&
-						args[i + 1].type != TOKEN_TYPE::INT)
-					{
-						err_.emplace_back(
-							EvalError::Exception::INVALID_ARG_TYPES,
-							L"< takes arg types: int int int...", token);
-						return false;
-					}
-					if (args[i] > args[i + 1])
-						return false;
+					err_.emplace_back(
+						EvalError::Exception::NOT_A_FUNCTION, func);
+					return {};
 				}
-				return true;
-			}(),
-			.type = TOKEN_TYPE::BOOL,
-		};
-	}
-	else if (!func.pname->compare(L"<"))
-	{
-		if (args.size() < 2)
-		{
-			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
-							  L"< takes 2 or more args", token);
-			return token_t{};
-		}
-		return token_t{
-			.is_true =
-				[&args, &token]()
+			}
+				[[fallthrough]];
+			case TOKEN_TYPE::LAMBDA:
 			{
-				for (size_t i{0}; i < args.size() - 1; i++)
+				// every call gets its own frame, so recursion doesn't
+				// clobber the arguments of the calls below it
+				std::shared_ptr<env_t> callee{acquire_frame(*func.env())};
+
+				// This takes the args in the list and applies them
+				// to the lambdas args
+				auto args{token.apval() | std::ranges::views::drop(1)};
+				for (size_t i{0};
+					 i < std::min(func.apval().size(), args.size()); i++)
 				{
-					if (args[i].type != TOKEN_TYPE::INT &&
-						args[i + 1].type != TOKEN_TYPE::INT)
-					{
-						err_.emplace_back(
-							EvalError::Exception::INVALID_ARG_TYPES,
-							L"< takes arg types: int int int...", token);
-						return false;
-					}
-					if (args[i] >= args[i + 1])
-						return false;
+					// put the args into the functions frame
+					callee->slots_[i] = walk(args[i], env);
 				}
-				return true;
-			}(),
-			.type = TOKEN_TYPE::BOOL,
-		};
-	}
-	else if (!func.pname->compare(L"and"))
-	{
-		if (args.size() < 2)
-		{
-			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
-							  L"and takes 2 or more args", token);
-			return token_t{};
-		}
-		return token_t{
-			.is_true =
-				[&args, &token]()
-			{
-				for (size_t i{0}; i < args.size() - 1; i++)
+
+				// only the first call is memoized, the calls after it are
+				// tail calls whose arguments are gone by the time the
+				// result is known
+				MemoTable* memo{first_call ? memo_for(func) : nullptr};
+				first_call = false;
+				if (memo)
 				{
-					if (args[i].type != TOKEN_TYPE::BOOL &&
-						args[i + 1].type != TOKEN_TYPE::BOOL)
+					if (auto hit{memo->find(func, callee->slots_,
+											max_depth_ - depth_)})
 					{
-						err_.emplace_back(
-							EvalError::Exception::INVALID_ARG_TYPES,
-							L"and takes arg types: bool bool bool...", token);
-						return false;
+						peak_ = std::max(peak_, depth_ + hit->depth);
+						release_frame(std::move(callee));
+						return hit->value;
 					}
-					if (!(args[i].is_true && args[i + 1].is_true))
-						return false;
 				}
-				return true;
-			}(),
-			.type = TOKEN_TYPE::BOOL,
-		};
-	}
-	else if (!func.pname->compare(L"or"))
-	{
-		if (args.size() < 2)
-		{
-			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
-							  L"or takes 2 or more args", token);
-			return token_t{};
-		}
-		return token_t{
-			.is_true =
-				[&args, &token]()
-			{
-				for (auto& i : args)
+
+				guard.call =
+					std::exchange(made_for, std::nullopt).value_or(token);
+				// the caller is done with its own frame, this is what keeps
+				// tail calls from piling up frames
+				if (frame)
+					release_frame(std::move(frame));
+				frame = std::move(callee);
+				env = frame;
+
+				if (memo)
 				{
-					if (i.type != TOKEN_TYPE::BOOL)
+					const size_t errors{err_.size()};
+					const size_t peak{std::exchange(peak_, depth_)};
+					token_t ret{};
+					if (func.code())
+						ret = execute(*func.code(), frame);
+					else
 					{
-						err_.emplace_back(
-							EvalError::Exception::INVALID_ARG_TYPES,
-							L"or takes arg types: bool bool bool...", token);
-						return false;
+						// the body takes the place of this walk, so it
+						// doesn't count towards the depth twice
+						depth_--;
+						body_walk_ = true;
+						ret = walk(*func.expr(), frame);
+						depth_++;
 					}
-					if (i.is_true)
-						return true;
+					// a result that came with errors is never reused
+					if (err_.size() == errors && !aborted_)
+						memo->insert(func, frame->slots_,
+									 {.value = ret, .depth = peak_ - depth_});
+					peak_ = std::max(peak, peak_);
+					return ret;
 				}
-				return false;
-			}(),
-			.type = TOKEN_TYPE::BOOL,
-		};
-	}
-	else if (!func.pname->compare(L"not"))
-	{
-		if (args.size() != 1)
-		{
-			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
-							  L"not takes 1 arg", token);
-			return token_t{};
+
+				// lambdas made by the bytecode engine carry their compiled
+				// body
+				if (func.code())
+					return execute(*func.code(), frame);
+
+				// evaluate the expression body within the new frame
+				owner = func.expr();
+				expr = owner.get();
+				continue;
+			}
+			default:
+				err_.emplace_back(EvalError::Exception::NOT_A_FUNCTION, func);
+				return {};
+			}
+			return {};
 		}
-		if (args[0].type != TOKEN_TYPE::BOOL)
-		{
-			err_.emplace_back(EvalError::Exception::INVALID_ARG_TYPES,
-							  L"not takes arg types: bool", token);
-			return token_t{};
+		case TOKEN_TYPE::LAMBDA:
+		case TOKEN_TYPE::DELIM:
+			// This should never be reached.
+			err_.emplace_back(EvalError::Exception::NOTREACHABLE, token);
+			return {};
 		}
-		return token_t{
-			.is_true = !args[0].is_true,
-			.type = TOKEN_TYPE::BOOL,
-		};
+
+		return token;
 	}
-	// And Finally if it couldn't find it...
-	return std::optional<token_t>{};
 };
 
-std::optional<token_t> Interpreter::special_functions(
-	const token_t& token,
-	const token_t& func,
-	std::span<const token_t> args,
-	std::weak_ptr<env_t> env)
+token_t* Interpreter::lookup(const token_t& symbol, env_t& env)
 {
-	assert(func.type == TOKEN_TYPE::SYMBOL);
-	if (!func.pname->compare(L"quit"))
-		err_.emplace_back(EvalError::Exception::QUIT, token_t{});
-	if (!func.pname->compare(L"if"))
+	switch (symbol.scope)
 	{
-		// if takes 3 arguments if test conseq alt
-		if (args.size() != 3)
-		{
-			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
-							  L"if takes 3 args", func);
-			return {};
-		}
+	case SCOPE::LEXICAL:
+		return &env.up(symbol.depth)->slots_[symbol.slot];
+	case SCOPE::GLOBAL:
+		return env_->curr_env_.find(symbol.pname);
+	case SCOPE::DYNAMIC:
+		break;
+	}
+	return env.find(symbol);
+}
 
-		// get the test value and make sure its a boolean
-		auto test{eval(args[0], env)};
+token_t* Interpreter::lookup(const token_t& symbol,
+							 const std::weak_ptr<env_t>& env)
+{
+	if (symbol.scope == SCOPE::GLOBAL)
+		return env_->curr_env_.find(symbol.pname);
+	return lookup(symbol, *env.lock());
+}
 
-		if (test.type != TOKEN_TYPE::BOOL)
-		{
-			err_.emplace_back(EvalError::Exception::INVALID_ARG_TYPES,
-							  L"if takes arg types: Bool any any", token);
-			return {};
-		}
+std::shared_ptr<env_t> Interpreter::make_frame(const token_t& params,
+											   std::shared_ptr<env_t> next)
+{
+	// not make_shared, the heap watches it through a weak_ptr which would keep
+	// a shared block allocated until the heap looks at it again
+	std::shared_ptr<env_t> frame{
+		new env_t{.env_name_{}, .curr_env_{}, .next_env_{std::move(next)}}};
+	Heap::track(frame);
 
-		// if test is true eval with conseq, else eval with alt
-		return eval(test.is_true ? args[1] : args[2], env);
+	// the arguments start out bound to themselves
+	for (const token_t& i : params.apval())
+	{
+		frame->names_.push_back(i.pname);
+		frame->slots_.push_back(i);
 	}
-	else if (!func.pname->compare(L"define"))
+	return frame;
+}
+
+std::shared_ptr<env_t> Interpreter::acquire_frame(const env_t& proto)
+{
+	if (frame_pool_.empty())
+		return std::make_shared<env_t>(
+			env_t{.env_name_{},
+				  .curr_env_{},
+				  .names_{proto.names_},
+				  .slots_{proto.slots_},
+				  .next_env_{proto.next_env_}});
+
+	std::shared_ptr<env_t> frame{std::move(frame_pool_.back())};
+	frame_pool_.pop_back();
+	// assigning keeps the capacity the frame had from its last call
+	frame->names_ = proto.names_;
+	frame->slots_ = proto.slots_;
+	frame->next_env_ = proto.next_env_;
+	return frame;
+}
+
+void Interpreter::release_frame(std::shared_ptr<env_t> frame)
+{
+	// a closure or an error made during the call can still reference it
+	if (frame.use_count() != 1 || frame_pool_.size() >= kMAX_POOLED_FRAMES)
+		return;
+
+	// drop what the call bound, so pooled frames don't keep values alive
+	frame->slots_.clear();
+	frame->next_env_.reset();
+	frame_pool_.push_back(std::move(frame));
+}
+
+std::vector<token_t> Interpreter::acquire_args()
+{
+	if (args_pool_.empty())
+		return {};
+	std::vector<token_t> args{std::move(args_pool_.back())};
+	args_pool_.pop_back();
+	return args;
+}
+
+void Interpreter::release_args(std::vector<token_t> args)
+{
+	// a builtin that moved its arguments out leaves nothing worth keeping
+	if (!args.capacity() || args_pool_.size() >= kMAX_POOLED_ARGS)
+		return;
+	args.clear();
+	args_pool_.push_back(std::move(args));
+}
+
+void Interpreter::resolve(token_t& token, const env_t& scope)
+{
+	if (token.quoted)
+		return;
+
+	switch (token.type)
 	{
-		// define takes 2 arguments define name value
-		if (args.size() != 2)
-		{
-			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
-							  L"define takes 2 args", token);
-			return {};
-		}
-		else if (args[0].type != TOKEN_TYPE::SYMBOL)
+	case TOKEN_TYPE::SYMBOL:
+	{
+		token.scope = SCOPE::DYNAMIC;
+		size_t depth{0};
+		for (const env_t* env{&scope}; env; env = env->next_env_.get())
 		{
-			err_.emplace_back(EvalError::Exception::INVALID_ARG_TYPES,
-							  L"Define takes arg types: symbol any", token);
-			return {};
+			if (env == env_.get())
+			{
+				token.scope = SCOPE::GLOBAL;
+				return;
+			}
+			// anything but a lambda frame can gain bindings later, leave
+			// the symbol to be searched for by name
+			if (env->curr_env_.size() || depth > token_t::kMAX_DEPTH)
+				return;
+			if (auto slot{env->slot_of(token.pname)})
+			{
+				// too far to fit in the token, leave it to the name lookup
+				if (*slot > token_t::kMAX_SLOT)
+					return;
+				token.scope = SCOPE::LEXICAL;
+				token.depth = depth;
+				token.slot = *slot;
+				return;
+			}
+			depth++;
 		}
-		// check that the symbol isn't already defined
-		else if (env_->find(args[0]).has_value())
+	}
+		return;
+	case TOKEN_TYPE::LIST:
+	{
+		if (token.apval().empty())
+			return;
+		// a body shares its lists with the form it came from, resolving
+		// writes to a private copy
+		auto args{std::span{token.apval_mut()}.subspan(1)};
+		token_t& func{token.apval_mut().front()};
+		resolve(func, scope);
+
+		if (func.type == TOKEN_TYPE::SYMBOL)
 		{
-			err_.emplace_back(EvalError::Exception::REDEFINITION, token);
-			return {};
+			// nested lambdas are resolved against their own frame when they
+			// get created
+			if (func.pname == kLAMBDA || func.pname == kDEFUN)
+				return;
+			// the target is always a global name, not a reference
+			if ((func.pname == kDEFINE || func.pname == kSET) &&
+				!args.empty())
+				args = args.subspan(1);
 		}
+		for (token_t& i : args)
+			resolve(i, scope);
+	}
+		return;
+	default:
+		return;
+	}
+}
 
-		token_t new_token{eval(args[1], env)};
+std::optional<token_t> Interpreter::fold(
+	const token_t& token,
+	std::vector<std::span<const token_t>>& scopes)
+{
+	if (token.quoted || token.type != TOKEN_TYPE::LIST ||
+		token.apval().empty())
+		return {};
 
-		// Assert that the pname is both non empty, and has a value (shared ptr)
-		assert(args[0].pname);
+	const auto items{token.apval()};
+	const token_t& head{items.front()};
+	// a binding of the name, an argument or a global, wins over the builtin
+	const builtin_t* builtin{nullptr};
+	if (head.type == TOKEN_TYPE::SYMBOL &&
+		!env_->curr_env_.contains(head.pname) &&
+		std::ranges::none_of(scopes,
+							 [&head](std::span<const token_t> scope)
+							 {
+								 return std::ranges::any_of(
+									 scope, [&head](const token_t& i)
+									 { return i.pname == head.pname; });
+							 }))
+		builtin = find_builtin(head.pname);
 
-		// define it in the global environment
-		env_->curr_env_.emplace(*args[0].pname, new_token);
-		return token_t{};
-	}
-	else if (!func.pname->compare(L"set!"))
+	// only the body, with the arguments in scope
+	if (builtin && (head.pname == kLAMBDA || head.pname == kDEFUN))
 	{
-		// set! takes 2 arguments define name value
-		if (args.size() != 2)
-		{
-			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
-							  L"set! takes 2 args", token);
+		const size_t params{head.pname == kLAMBDA ? 1u : 2u};
+		if (items.size() != params + 2 ||
+			items[params].type != TOKEN_TYPE::LIST)
 			return {};
-		}
-		else if (args[0].type != TOKEN_TYPE::SYMBOL)
-		{
-			err_.emplace_back(EvalError::Exception::INVALID_ARG_TYPES,
-							  L"set takes arg types: symbol any", token);
+		scopes.push_back(items[params].apval());
+		auto body{fold(items[params + 1], scopes)};
+		scopes.pop_back();
+		if (!body.has_value())
 			return {};
-		}
-		// check that the symbol is already defined
-		else if (!env_->find(args[0]).has_value())
+		// the body as written is kept next to the folded one, it runs instead
+		// once anything folded into it is defined over
+		folded_.insert(head.pname);
+		token_t ret{token};
+		ret.apval_mut()[params + 1] = token_t::make_list(
+			elements_t{token_t{.pname = kFOLDED, .type = TOKEN_TYPE::SYMBOL},
+					   std::move(body).value(), items[params + 1]});
+		return ret;
+	}
+
+	std::optional<token_t> ret{};
+	for (size_t i{0}; i < items.size(); i++)
+		if (auto item{fold(items[i], scopes)})
 		{
-			err_.emplace_back(
-				EvalError::Exception::UNDEFINED, args[0], env.lock());
-			return {};
+			if (!ret.has_value())
+				ret = token;
+			ret->apval_mut()[i] = std::move(item).value();
 		}
-		// Assert that the pname is both non empty, and has a value (shared ptr)
-		assert(args[0].pname);
-		// replace the old token
-		env_->curr_env_.insert_or_assign(*args[0].pname, eval(args[1], env));
 
-		return token_t{};
-	}
-	else if (!func.pname->compare(L"defun"))
-	// equivalent to (define name (lambda (args) (expr)))
+	// outside of a body the form runs once anyway
+	if (!builtin || scopes.empty())
+		return ret;
+
+	const auto folded{ret.has_value() ? ret->apval() : items};
+	auto args{folded.subspan(1)};
+	if (head.pname == kIF)
 	{
-		// Lambdas only take 3 args, defun name (args) (body)
 		if (args.size() != 3)
-		{
-			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
-							  L"defun takes 3 args", token);
-			return {};
-		}
-		else if (args[0].type != TOKEN_TYPE::SYMBOL ||
-				 args[1].type != TOKEN_TYPE::LIST ||
-				 [&args]()
-				 {
-					 for (const token_t& i : args[1].apval)
-						 if (i.type != TOKEN_TYPE::SYMBOL)
-							 return true;
-					 return false;
-				 }() ||
-				 args[2].type != TOKEN_TYPE::LIST)
-		{
-			err_.emplace_back(
-				EvalError::Exception::INVALID_ARG_TYPES,
-				L"defun takes arg types: symbol list(symbols) list", token);
-			return {};
-		}
-		// check that the function isn't already defined
-		else if (env_->find(args[0]).has_value())
-		{
-			err_.emplace_back(EvalError::Exception::REDEFINITION, token);
-			return {};
-		}
-
-		std::shared_ptr<env_t> new_env{std::make_shared<env_t>(
-			env_t{.env_name_{}, .curr_env_{}, .next_env_{env.lock()}})};
+			return ret;
+		auto test{ConstantValue(args[0])};
+		if (!test.has_value() || test->type != TOKEN_TYPE::BOOL)
+			return ret;
+		folded_.insert(head.pname);
+		return test->is_true ? args[1] : args[2];
+	}
+	if (!builtin->pure)
+		return ret;
 
-		// put the arguments into the new environment
-		for (auto i : args[1].apval)
-			new_env->curr_env_.emplace(*i.pname, i);
+	std::vector<token_t> values{};
+	for (const token_t& i : args)
+	{
+		auto value{ConstantValue(i)};
+		if (!value.has_value() || value->big())
+			return ret;
+		values.push_back(std::move(value).value());
+	}
+	if (head.pname == kPOW && values.size() == 2 &&
+		values[1].type == TOKEN_TYPE::INT && values[1].val > kMAX_FOLDED_EXP)
+		return ret;
 
-		// make sure the pname has a value
-		assert(args[0].pname);
-		// Create the function, ap val is the argument list,
-		// expr is the body object, the environment is locked to
-		// the current environment
-		// define it in the global environment
-		env_->curr_env_.emplace(
-			*args[0].pname,
-			token_t{.type = TOKEN_TYPE::LAMBDA,
-					.pname{args[0].pname},
-					.apval{args[1].apval},
-					.expr{std::make_shared<token_t>(args[2])},
-					.env{std::move(new_env)}});
-		return token_t{};
+	// the errors stay with the call, to be raised when it runs. It keeps its
+	// args as written too, so the error shows the form that was written
+	const size_t errors{err_.size()};
+	auto value{(this->*builtin->builtin)(token, head, values, env_)};
+	if (!value.has_value() || err_.size() != errors)
+	{
+		err_.resize(errors);
+		return {};
 	}
-	else if (!func.pname->compare(L"lambda"))
+	folded_.insert(head.pname);
+	return Literal(std::move(value).value());
+}
+
+bool Interpreter::pure(const token_t& fn)
+{
+	return purity_t{*env_}.function(fn);
+}
+
+void Interpreter::changed_global(symbol_t name)
+{
+	version_++;
+	if (folded_.contains(name))
+		unfolded_ = true;
+}
+
+MemoTable* Interpreter::memo_for(const token_t& fn)
+{
+	if (!memo_.capacity() || !fn.pname)
+		return nullptr;
+
+	// workers see the globals of the interpreter they work for
+	const size_t version{parent_ ? parent_->version_ : version_};
+	if (memo_version_ != version)
 	{
-		// Lambdas only take 2 args, lambda (args) (body)
-		if (args.size() != 2)
-		{
-			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
-							  L"lambda takes 2 args", token);
-			return {};
-		}
-		else if (args[0].type != TOKEN_TYPE::LIST ||
-				 // Dirty lambdas
-				 [&args]()
-				 {
-					 for (const token_t& i : args[0].apval)
-						 if (i.type != TOKEN_TYPE::SYMBOL)
-							 return true;
-					 return false;
-				 }() ||
+		memo_.clear();
+		memoize_.clear();
+		memo_version_ = version;
+	}
 
-				 args[1].type != TOKEN_TYPE::LIST)
-		{
-			err_.emplace_back(
-				EvalError::Exception::INVALID_ARG_TYPES,
-				L"lambda takes ar types: list(symbols) list", token);
-			return {};
-		}
+	auto [verdict, added]{memoize_.try_emplace(fn.object.get(), fn, false)};
+	if (added)
+	{
+		purity_t purity{*env_};
+		verdict->second.second = purity.function(fn) && purity.recursive();
+	}
+	return verdict->second.second ? &memo_ : nullptr;
+}
 
-		std::shared_ptr<env_t> new_env{std::make_shared<env_t>(
-			env_t{.env_name_{}, .curr_env_{}, .next_env_{env.lock()}})};
+memo_stats_t Interpreter::get_memo_stats()
+{
+	memo_stats_t ret{memo_.stats()};
+	for (auto& i : workers_)
+	{
+		const memo_stats_t stats{i->memo_.stats()};
+		ret.hits += stats.hits;
+		ret.misses += stats.misses;
+		ret.evictions += stats.evictions;
+		ret.entries += stats.entries;
+	}
+	return ret;
+}
 
-		// put the arguments into the new environment
-		for (auto i : args[0].apval)
-			new_env->curr_env_.emplace(*i.pname, i);
+WorkPool& Interpreter::pool()
+{
+	if (!pool_)
+	{
+		pool_ = std::make_unique<WorkPool>(
+			threads_ ? threads_ : std::thread::hardware_concurrency());
+		for (size_t i{0}; i < pool_->size(); i++)
+			workers_.emplace_back(new Interpreter{this});
+	}
+	return *pool_;
+}
 
-		// Create the lambda, ap val is the argument list, expr
-		// is the body object, the environment is locked to the
-		// current environment
-		return token_t{.type = TOKEN_TYPE::LAMBDA,
-					   .apval{args[0].apval},
-					   .expr{std::make_shared<token_t>(args[1])},
-					   .env{std::move(new_env)}};
+void Interpreter::for_each_index(
+	size_t count,
+	bool parallel,
+	const std::function<void(Interpreter&, size_t)>& task)
+{
+	// a worker doesn't start a pool of its own
+	if (!parallel || parent_)
+	{
+		for (size_t i{0}; i < count; i++)
+			task(*this, i);
+		return;
 	}
-	if (!func.pname->compare(L"funcall"))
+
+	pool();
+	for (auto& i : workers_)
 	{
-		if (args.size() < 1)
+		// the workers start out as deep as this one is now
+		i->engine_ = engine_;
+		i->max_depth_ = max_depth_ > depth_ ? max_depth_ - depth_ : 0;
+	}
+
+	// the errors every index raised, moved to err_ in order once all are done
+	std::vector<std::vector<EvalError>> raised(count);
+	pool_->run(count,
+			   [this, &task, &raised](size_t worker, size_t i)
+			   {
+				   Interpreter& interp{*workers_[worker]};
+				   // whatever the worker makes is this ones to collect
+				   Heap::Scope heap_scope{heap_};
+				   task(interp, i);
+				   if (interp.aborted_)
+				   {
+					   while (interp.err_.size() > interp.abort_at_)
+						   interp.err_.pop_back();
+					   interp.aborted_ = false;
+					   interp.blame_call_ = false;
+				   }
+				   raised[i] = std::move(interp.err_);
+				   interp.err_.clear();
+			   });
+
+	for (auto& i : raised)
+		for (auto& j : i)
 		{
-			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
-							  L"funcall takes at least 1 arg", token);
-			return token_t{};
+			err_.push_back(std::move(j));
+			// running out of depth abandons the whole evaluation, one after
+			// the other nothing past this would have run
+			if (err_.back().err_ == EvalError::Exception::MAX_DEPTH)
+			{
+				aborted_ = true;
+				abort_at_ = err_.size();
+				return;
+			}
 		}
+}
 
-		// funcall evaluates the first argument and then passes the rest of the
-		// arguments
-		token_t to_eval{.type = TOKEN_TYPE::LIST,
-						.apval = {std::next(args.begin()), args.end()}};
-		to_eval.apval.emplace(to_eval.apval.begin(), eval(args.front(), env));
+const Interpreter::builtin_t* Interpreter::find_builtin(symbol_t name)
+{
+	static const builtin_t kBUILTINS[]{
+		{.name = kQUIT, .special = &Interpreter::special_quit},
+		{.name = kIF, .special = &Interpreter::special_if},
+		{.name = kDEFINE, .special = &Interpreter::special_define},
+		{.name = kSET, .special = &Interpreter::special_set},
+		{.name = kDEFUN, .special = &Interpreter::special_defun},
+		{.name = kLAMBDA, .special = &Interpreter::special_lambda},
+		{.name = kFOLDED, .special = &Interpreter::special_folded},
+		{.name = kFUNCALL, .special = &Interpreter::special_funcall},
+		{.name = kLOAD, .special = &Interpreter::special_load},
+		{.name = kPRINT, .builtin = &Interpreter::builtin_print},
+		{.name = kMAPCAR, .builtin = &Interpreter::builtin_mapcar},
+		{.name = kPMAPCAR, .builtin = &Interpreter::builtin_pmapcar},
+		{.name = kPFILTER, .builtin = &Interpreter::builtin_pfilter},
+		{.name = kPREDUCE, .builtin = &Interpreter::builtin_preduce},
+		{.name = kCAR, .builtin = &Interpreter::builtin_car, .pure = true},
+		{.name = kCDR, .builtin = &Interpreter::builtin_cdr, .pure = true},
+		// evaluates its first arg again, which can be any form
+		{.name = kCONS, .builtin = &Interpreter::builtin_cons},
+		{.name = kSQRT, .builtin = &Interpreter::builtin_sqrt, .pure = true},
+		{.name = kPOW, .builtin = &Interpreter::builtin_pow, .pure = true},
+		{.name = kADD, .builtin = &Interpreter::builtin_add, .pure = true},
+		{.name = kSUB, .builtin = &Interpreter::builtin_sub, .pure = true},
+		{.name = kMUL, .builtin = &Interpreter::builtin_mul, .pure = true},
+		{.name = kDIV, .builtin = &Interpreter::builtin_div, .pure = true},
+		{.name = kEQ, .builtin = &Interpreter::builtin_eq, .pure = true},
+		{.name = kNE, .builtin = &Interpreter::builtin_ne, .pure = true},
+		{.name = kGE, .builtin = &Interpreter::builtin_ge, .pure = true},
+		{.name = kGT, .builtin = &Interpreter::builtin_gt, .pure = true},
+		{.name = kLE, .builtin = &Interpreter::builtin_le, .pure = true},
+		{.name = kLT, .builtin = &Interpreter::builtin_lt, .pure = true},
+		{.name = kAND, .builtin = &Interpreter::builtin_and, .pure = true},
+		{.name = kOR, .builtin = &Interpreter::builtin_or, .pure = true},
+		{.name = kNOT, .builtin = &Interpreter::builtin_not, .pure = true},
+	};
 
-		return eval(to_eval, env);
-	}
+	// The builtin names are interned before any user symbol, so the registry
+	// is a small array indexed by the symbol id itself
+	static const std::vector<const builtin_t*> kREGISTRY{[]()
+	{
+		std::vector<const builtin_t*> registry{};
+		for (const builtin_t& i : kBUILTINS)
+		{
+			if (i.name >= registry.size())
+				registry.resize(i.name + 1);
+			registry[i.name] = &i;
+		}
+		return registry;
+	}()};
 
-	return {};
+	return name < kREGISTRY.size() ? kREGISTRY[name] : nullptr;
+}
+
+std::optional<token_t> Interpreter::default_functions(
+	const token_t& token,
+	const token_t& func,
+	const builtin_t* builtin,
+	std::span<const token_t> raw_args,
+	std::weak_ptr<env_t> env)
+{
+	assert(func.type == TOKEN_TYPE::SYMBOL);
+
+	// Runs special functions that modify the environment
+	if (builtin && builtin->special)
+	{
+		auto ret{(this->*builtin->special)(token, func, raw_args, env)};
+		if (ret.has_value())
+			return ret.value();
+	}
+
+	// for the rest of these the args are evaluated, even when the special
+	// function gave up
+	std::vector<token_t> args{acquire_args()};
+	args.reserve(raw_args.size());
+	for (const token_t& i : raw_args)
+		args.push_back(walk(i, env));
+
+	std::optional<token_t> ret{};
+	if (builtin && builtin->builtin)
+		ret = (this->*builtin->builtin)(token, func, args, env);
+	// And Finally if it couldn't find it, ret is empty
+	release_args(std::move(args));
+	return ret;
+}
+
+std::optional<token_t> Interpreter::special_quit(
+	const token_t&,
+	const token_t&,
+	std::span<const token_t>,
+	std::weak_ptr<env_t>)
+{
+	err_.emplace_back(EvalError::Exception::QUIT, token_t{});
+	return {};
+}
+
+std::optional<token_t> Interpreter::special_if(
+	const token_t& token,
+	const token_t& func,
+	std::span<const token_t> args,
+	std::weak_ptr<env_t> env)
+{
+	// if takes 3 arguments if test conseq alt
+	if (args.size() != 3)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"if takes 3 args", func);
+		return {};
+	}
+
+	// get the test value and make sure its a boolean
+	auto test{walk(args[0], env)};
+
+	if (test.type != TOKEN_TYPE::BOOL)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_ARG_TYPES,
+						  L"if takes arg types: Bool any any", token);
+		return {};
+	}
+
+	// if test is true eval with conseq, else eval with alt. The branch is in
+	// tail position, walk evaluates it
+	tail_ = tail_t{.owner{}, .expr = &(test.is_true ? args[1] : args[2])};
+	return token_t{};
+}
+
+std::optional<token_t> Interpreter::special_define(
+	const token_t& token,
+	const token_t&,
+	std::span<const token_t> args,
+	std::weak_ptr<env_t> env)
+{
+	// define takes 2 arguments define name value
+	if (args.size() != 2)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"define takes 2 args", token);
+		return {};
+	}
+	else if (args[0].type != TOKEN_TYPE::SYMBOL)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_ARG_TYPES,
+						  L"Define takes arg types: symbol any", token);
+		return {};
+	}
+	// check that the symbol isn't already defined
+	else if (env_->find(args[0]))
+	{
+		err_.emplace_back(EvalError::Exception::REDEFINITION, token);
+		return {};
+	}
+
+	token_t new_token{walk(args[1], env)};
+	// don't bind a value an abandoned evaluation made up
+	if (aborted_)
+		return token_t{};
+
+	// Assert that the pname is non empty
+	assert(args[0].pname);
+
+	// define it in the global environment
+	env_->curr_env_.emplace(args[0].pname, new_token);
+	changed_global(args[0].pname);
+	return token_t{};
+}
+
+std::optional<token_t> Interpreter::special_set(
+	const token_t& token,
+	const token_t&,
+	std::span<const token_t> args,
+	std::weak_ptr<env_t> env)
+{
+	// set! takes 2 arguments define name value
+	if (args.size() != 2)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"set! takes 2 args", token);
+		return {};
+	}
+	else if (args[0].type != TOKEN_TYPE::SYMBOL)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_ARG_TYPES,
+						  L"set takes arg types: symbol any", token);
+		return {};
+	}
+	// check that the symbol is already defined
+	else if (!env_->find(args[0]))
+	{
+		err_.emplace_back(
+			EvalError::Exception::UNDEFINED, args[0], env.lock());
+		return {};
+	}
+	// Assert that the pname is non empty
+	assert(args[0].pname);
+	// replace the old token, unless the evaluation was abandoned
+	token_t value{walk(args[1], env)};
+	if (!aborted_)
+	{
+		env_->curr_env_.insert_or_assign(args[0].pname, std::move(value));
+		changed_global(args[0].pname);
+	}
+
+	return token_t{};
+}
+
+std::optional<token_t> Interpreter::special_defun(
+	const token_t& token,
+	const token_t&,
+	std::span<const token_t> args,
+	std::weak_ptr<env_t> env)
+{
+	// equivalent to (define name (lambda (args) (expr)))
+	{
+		// Lambdas only take 3 args, defun name (args) (body)
+		if (args.size() != 3)
+		{
+			err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+							  L"defun takes 3 args", token);
+			return {};
+		}
+		else if (args[0].type != TOKEN_TYPE::SYMBOL ||
+				 args[1].type != TOKEN_TYPE::LIST ||
+				 [&args]()
+				 {
+					 for (const token_t& i : args[1].apval())
+						 if (i.type != TOKEN_TYPE::SYMBOL)
+							 return true;
+					 return false;
+				 }() ||
+				 args[2].type != TOKEN_TYPE::LIST)
+		{
+			err_.emplace_back(
+				EvalError::Exception::INVALID_ARG_TYPES,
+				L"defun takes arg types: symbol list(symbols) list", token);
+			return {};
+		}
+		// check that the function isn't already defined
+		else if (env_->find(args[0]))
+		{
+			err_.emplace_back(EvalError::Exception::REDEFINITION, token);
+			return {};
+		}
+
+		std::shared_ptr<env_t> new_env{make_frame(args[1], env.lock())};
+
+		// resolve the body against the new frame once, so evaluating it
+		// never searches for a symbol by name
+		auto body{std::make_shared<token_t>(args[2])};
+		resolve(*body, *new_env);
+
+		// make sure the pname has a value
+		assert(args[0].pname);
+		// Create the function, ap val is the argument list,
+		// expr is the body object, the environment is locked to
+		// the current environment
+		// define it in the global environment
+		env_->curr_env_.emplace(
+			args[0].pname,
+			token_t::make_lambda(args[1].apval(), std::move(body),
+								 std::move(new_env), {}, args[0].pname));
+		changed_global(args[0].pname);
+		return token_t{};
+	}
+}
+
+std::optional<token_t> Interpreter::special_folded(
+	const token_t&,
+	const token_t&,
+	std::span<const token_t> args,
+	std::weak_ptr<env_t>)
+{
+	// only fold makes these, the body it folded and the body as written. The
+	// one taken is in tail position, walk evaluates it
+	tail_ = tail_t{.owner{}, .expr = &args[unfolded() ? 1 : 0]};
+	return token_t{};
+}
+
+std::optional<token_t> Interpreter::special_lambda(
+	const token_t& token,
+	const token_t&,
+	std::span<const token_t> args,
+	std::weak_ptr<env_t> env)
+{
+	// Lambdas only take 2 args, lambda (args) (body)
+	if (args.size() != 2)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"lambda takes 2 args", token);
+		return {};
+	}
+	else if (args[0].type != TOKEN_TYPE::LIST ||
+			 // Dirty lambdas
+			 [&args]()
+			 {
+				 for (const token_t& i : args[0].apval())
+					 if (i.type != TOKEN_TYPE::SYMBOL)
+						 return true;
+				 return false;
+			 }() ||
+
+			 args[1].type != TOKEN_TYPE::LIST)
+	{
+		err_.emplace_back(
+			EvalError::Exception::INVALID_ARG_TYPES,
+			L"lambda takes ar types: list(symbols) list", token);
+		return {};
+	}
+
+	std::shared_ptr<env_t> new_env{make_frame(args[0], env.lock())};
+
+	auto body{std::make_shared<token_t>(args[1])};
+	resolve(*body, *new_env);
+
+	// Create the lambda, ap val is the argument list, expr
+	// is the body object, the environment is locked to the
+	// current environment
+	return token_t::make_lambda(args[0].apval(), std::move(body),
+								std::move(new_env));
+}
+
+std::optional<token_t> Interpreter::special_funcall(
+	const token_t& token,
+	const token_t&,
+	std::span<const token_t> args,
+	std::weak_ptr<env_t> env)
+{
+	if (args.size() < 1)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"funcall takes at least 1 arg", token);
+		return token_t{};
+	}
+
+	// funcall evaluates the first argument and then passes the rest of the
+	// arguments
+	elements_t call{walk(args.front(), env)};
+	call.insert(call.end(), std::next(args.begin()), args.end());
+	token_t to_eval{token_t::make_list(std::move(call))};
+
+	// the call is in tail position, walk evaluates it
+	auto owner{std::make_shared<const token_t>(std::move(to_eval))};
+	tail_ = tail_t{.owner{owner}, .expr = owner.get(), .call{token}};
+	return token_t{};
+}
+
+std::optional<token_t> Interpreter::special_load(
+	const token_t& token,
+	const token_t&,
+	std::span<const token_t> args,
+	std::weak_ptr<env_t> env)
+{
+	if (args.size() != 1)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"load takes 1 arg", token);
+		return token_t{};
+	}
+	// there are no strings, the path is read as a symbol. "file" and 'file
+	// are both the path file
+	if (args[0].type != TOKEN_TYPE::SYMBOL)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_ARG_TYPES,
+						  L"load takes arg types: symbol", token);
+		return token_t{};
+	}
+
+	std::wstring_view path{SymbolTable::name(args[0].pname)};
+	if (path.size() > 1 && path.starts_with(L'"') && path.ends_with(L'"'))
+		path = path.substr(1, path.size() - 2);
+	return load(std::filesystem::path{path}, env);
+}
+
+std::optional<token_t> Interpreter::builtin_print(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t> env)
+{
+	if (args.size() != 1)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"print takes 1 arg", token);
+		return token_t{};
+	}
+
+	args[0].quoted = true;
+
+	return walk(args[0], env);
+}
+
+std::optional<token_t> Interpreter::builtin_mapcar(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t> env)
+{
+	// mapcar takes at least 2 args, mapcar func args args args ...
+	if (args.size() < 2)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"mapcar takes 2 or more args", token);
+		return {};
+	}
+	else if ((args[0].type != TOKEN_TYPE::SYMBOL &&
+			  args[0].type != TOKEN_TYPE::LAMBDA) ||
+			 // The rest of the arguments are a list
+			 [args]()
+			 {
+				 // for each argument in the args (thats not the function)
+				 for (const token_t& i : args | std::ranges::views::drop(1))
+					 if (i.type != TOKEN_TYPE::LIST)
+						 return true;
+				 return false;
+			 }())
+	{
+		err_.emplace_back(
+			EvalError::Exception::INVALID_ARG_TYPES,
+			L"mapcar takes arg types: lamba/symbol list list ...", token);
+		return token_t{};
+	}
+
+	elements_t results{};
+	for (const token_t& i : MapCalls(args))
+		results.push_back(walk(i, env));
+
+	return token_t::make_list(std::move(results));
+}
+
+std::optional<token_t> Interpreter::builtin_pmapcar(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t> env)
+{
+	if (args.size() < 2)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"pmapcar takes 2 or more args", token);
+		return {};
+	}
+	else if ((args[0].type != TOKEN_TYPE::SYMBOL &&
+			  args[0].type != TOKEN_TYPE::LAMBDA) ||
+			 !std::ranges::all_of(args | std::ranges::views::drop(1),
+								  [](const token_t& i)
+								  { return i.type == TOKEN_TYPE::LIST; }))
+	{
+		err_.emplace_back(
+			EvalError::Exception::INVALID_ARG_TYPES,
+			L"pmapcar takes arg types: lamba/symbol list list ...", token);
+		return token_t{};
+	}
+
+	const std::vector<token_t> calls{MapCalls(args)};
+	elements_t results(calls.size());
+	for_each_index(calls.size(),
+				   calls.size() >= kMIN_PARALLEL && pure(args[0]),
+				   [&calls, &results, &env](Interpreter& interp, size_t i)
+				   { results[i] = interp.walk(calls[i], env); });
+
+	return token_t::make_list(std::move(results));
+}
+
+std::optional<token_t> Interpreter::builtin_pfilter(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t> env)
+{
+	if (args.size() != 2)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"pfilter takes 2 args", token);
+		return {};
+	}
+	else if ((args[0].type != TOKEN_TYPE::SYMBOL &&
+			  args[0].type != TOKEN_TYPE::LAMBDA) ||
+			 args[1].type != TOKEN_TYPE::LIST)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_ARG_TYPES,
+						  L"pfilter takes arg types: lamba/symbol list", token);
+		return token_t{};
+	}
+
+	const std::vector<token_t> calls{MapCalls(args)};
+	std::vector<token_t> keep(calls.size());
+	for_each_index(calls.size(),
+				   calls.size() >= kMIN_PARALLEL && pure(args[0]),
+				   [&calls, &keep, &env](Interpreter& interp, size_t i)
+				   { keep[i] = interp.walk(calls[i], env); });
+
+	elements_t results{};
+	for (size_t i{0}; i < keep.size(); i++)
+	{
+		if (keep[i].type != TOKEN_TYPE::BOOL)
+		{
+			err_.emplace_back(EvalError::Exception::INVALID_ARG_TYPES,
+							  L"pfilter's function has to return a bool",
+							  calls[i]);
+			return token_t{};
+		}
+		if (keep[i].is_true)
+			results.push_back(args[1].apval()[i]);
+	}
+	return token_t::make_list(std::move(results));
+}
+
+std::optional<token_t> Interpreter::builtin_preduce(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t> env)
+{
+	if (args.size() != 3)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"preduce takes 3 args", token);
+		return {};
+	}
+	else if ((args[0].type != TOKEN_TYPE::SYMBOL &&
+			  args[0].type != TOKEN_TYPE::LAMBDA) ||
+			 args[2].type != TOKEN_TYPE::LIST)
+	{
+		err_.emplace_back(
+			EvalError::Exception::INVALID_ARG_TYPES,
+			L"preduce takes arg types: lamba/symbol any list", token);
+		return token_t{};
+	}
+
+	const token_t& func{args[0]};
+	const std::span<const token_t> list{args[2].apval()};
+	auto call = [&func, &env](Interpreter& interp, token_t l, token_t r)
+	{
+		return interp.walk(
+			token_t::make_list(elements_t{func, std::move(l), std::move(r)}),
+			env);
+	};
+
+	if (list.size() < kMIN_PARALLEL || parent_ || !pure(func))
+	{
+		token_t ret{args[1]};
+		for (const token_t& i : list)
+			ret = call(*this, std::move(ret), i);
+		return ret;
+	}
+
+	// The function is associative, so every chunk can be folded on its own
+	// and the chunks folded into the initial value afterwards, in order
+	const size_t chunks{
+		std::min(list.size(), pool().size() * kCHUNKS_PER_WORKER)};
+	std::vector<token_t> folded(chunks);
+	for_each_index(
+		chunks, true,
+		[&list, &folded, &call, chunks](Interpreter& interp, size_t chunk)
+		{
+			const size_t first{list.size() * chunk / chunks};
+			const size_t last{list.size() * (chunk + 1) / chunks};
+			folded[chunk] = list[first];
+			for (size_t i{first + 1}; i < last; i++)
+				folded[chunk] = call(interp, std::move(folded[chunk]), list[i]);
+		});
+
+	token_t ret{args[1]};
+	for (token_t& i : folded)
+		ret = call(*this, std::move(ret), std::move(i));
+	return ret;
+}
+
+std::optional<token_t> Interpreter::builtin_car(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t>)
+{
+	if (args.size() != 1)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"car takes 1 arg", token);
+		return token_t{};
+	}
+	else if (args[0].type != TOKEN_TYPE::LIST)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_ARG_TYPES,
+						  L"car takes arg types: list", token);
+		return token_t{};
+	}
+	// the car of the empty list is the empty list
+	if (args[0].apval().empty())
+		return args[0];
+	return args[0].apval().front();
+}
+
+std::optional<token_t> Interpreter::builtin_cdr(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t>)
+{
+	if (args.size() != 1)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"cdr takes 1 arg", token);
+		return token_t{};
+	}
+	else if (args[0].type != TOKEN_TYPE::LIST)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_ARG_TYPES,
+						  L"cdr takes arg types: list", token);
+		return token_t{};
+	}
+	return args[0].cdr();
+}
+
+std::optional<token_t> Interpreter::builtin_cons(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t> env)
+{
+	if (args.size() != 2)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"cons takes 2 args", token);
+		return token_t{};
+	}
+	else if (args[1].type != TOKEN_TYPE::LIST)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_ARG_TYPES,
+						  L"cons takes arg types: any list", token);
+		return token_t{};
+	}
+
+	return token_t::make_cons(walk(args[0], env), args[1]);
+}
+
+std::optional<token_t> Interpreter::builtin_sqrt(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t>)
+{
+	if (args.size() != 1)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"sqrt takes 1 arg", token);
+		return token_t{};
+	}
+	if (args[0].type != TOKEN_TYPE::INT || args[0].val < 0 ||
+		(args[0].big() && args[0].big()->negative()))
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_ARG_TYPES,
+						  L"sqrt takes arg types: non negative int", token);
+		return token_t{};
+	}
+
+	if (const BigInt* big{args[0].big()})
+		return token_t::make_int(big->isqrt());
+	return token_t{
+		.val = static_cast<int64_t>(ISqrt(static_cast<uint64_t>(args[0].val))),
+		.type = TOKEN_TYPE::INT,
+	};
+}
+
+std::optional<token_t> Interpreter::builtin_pow(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t>)
+{
+	if (args.size() != 2)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"exp takes 2 args", token);
+		return token_t{};
+	}
+	if (args[0].type != TOKEN_TYPE::INT || args[1].type != TOKEN_TYPE::INT)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_ARG_TYPES,
+						  L"exp takes arg types: int int", token);
+		return token_t{};
+	}
+
+	const token_t& base{args[0]};
+	const token_t& exp{args[1]};
+	const bool exp_negative{exp.big() ? exp.big()->negative() : exp.val < 0};
+	// only 0, 1 and -1 have a power that isnt a fraction or too big to hold
+	// for every exponent
+	if (!base.big() && base.val >= -1 && base.val <= 1 &&
+		(exp_negative || exp.big()))
+	{
+		if (!base.val && exp_negative)
+		{
+			err_.emplace_back(EvalError::Exception::DIVIDE_BY_ZERO, token);
+			return token_t{};
+		}
+		const bool odd{exp.big() ? ToBig(exp) / BigInt{2} * BigInt{2} !=
+									   ToBig(exp)
+								 : (exp.val & 1) != 0};
+		return token_t{
+			.val = base.val == -1 && !odd ? 1 : base.val,
+			.type = TOKEN_TYPE::INT,
+		};
+	}
+	// a fraction, rounded towards zero like division
+	if (exp_negative)
+		return token_t{.val = 0, .type = TOKEN_TYPE::INT};
+	if (exp.big())
+	{
+		err_.emplace_back(EvalError::Exception::OVERFLOW, token);
+		return token_t{};
+	}
+
+	if (!base.big())
+		if (auto res{PowFixnum(base.val, static_cast<uint64_t>(exp.val))})
+			return token_t{.val = *res, .type = TOKEN_TYPE::INT};
+	return token_t::make_int(ToBig(base).pow(static_cast<uint64_t>(exp.val)));
+}
+
+std::optional<token_t> Interpreter::builtin_add(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t>)
+{
+	if (!AllInts(args))
+	{
+		err_.emplace_back(EvalError::Exception::MATH_ERR, token);
+		return token_t{};
+	}
+	return FoldInts(
+		token_t{.val = 0, .type = TOKEN_TYPE::INT}, args,
+		[](int64_t l, int64_t r, int64_t* res)
+		{ return __builtin_add_overflow(l, r, res); },
+		[](const BigInt& l, const BigInt& r) { return l + r; });
+}
+
+std::optional<token_t> Interpreter::builtin_sub(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t>)
+{
+	if (args.empty())
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"- takes 1 or more args", token);
+		return token_t{};
+	}
+	if (!AllInts(args))
+	{
+		err_.emplace_back(EvalError::Exception::MATH_ERR, token);
+		return token_t{};
+	}
+	return FoldInts(
+		args[0], std::span{args}.subspan(1),
+		[](int64_t l, int64_t r, int64_t* res)
+		{ return __builtin_sub_overflow(l, r, res); },
+		[](const BigInt& l, const BigInt& r) { return l - r; });
+}
+
+std::optional<token_t> Interpreter::builtin_mul(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t>)
+{
+	if (!AllInts(args))
+	{
+		err_.emplace_back(EvalError::Exception::MATH_ERR, token);
+		return token_t{};
+	}
+	return FoldInts(
+		token_t{.val = 1, .type = TOKEN_TYPE::INT}, args,
+		[](int64_t l, int64_t r, int64_t* res)
+		{ return __builtin_mul_overflow(l, r, res); },
+		[](const BigInt& l, const BigInt& r) { return l * r; });
+}
+
+std::optional<token_t> Interpreter::builtin_div(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t>)
+{
+	if (args.empty())
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"/ takes 1 or more args", token);
+		return token_t{};
+	}
+	if (!AllInts(args))
+	{
+		err_.emplace_back(EvalError::Exception::MATH_ERR, token);
+		return token_t{};
+	}
+	// a big int is never 0
+	for (const token_t& i : std::span{args}.subspan(1))
+		if (!i.big() && !i.val)
+		{
+			err_.emplace_back(EvalError::Exception::DIVIDE_BY_ZERO, i);
+			return token_t{};
+		}
+	return FoldInts(
+		args[0], std::span{args}.subspan(1),
+		[](int64_t l, int64_t r, int64_t* res)
+		{
+			// the one quotient that doesn't fit
+			if (l == std::numeric_limits<int64_t>::min() && r == -1)
+				return true;
+			*res = l / r;
+			return false;
+		},
+		[](const BigInt& l, const BigInt& r) { return l / r; });
+}
+
+std::optional<token_t> Interpreter::builtin_eq(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t>)
+{
+	if (args.size() < 2)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"= takes 2 or more args", token);
+		return token_t{};
+	}
+	return token_t::make_bool(
+		[&args]()
+		{
+			for (size_t i{0}; i < args.size() - 1; i++)
+				if (args[i] != args[i + 1])
+					return false;
+			return true;
+		}());
+}
+
+std::optional<token_t> Interpreter::builtin_ne(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t>)
+{
+	if (args.size() < 2)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"= takes 2 or more args", token);
+		return token_t{};
+	}
+	return token_t::make_bool(
+		[&args]()
+		{
+			for (size_t i{0}; i < args.size() - 1; i++)
+				if (args[i] == args[i + 1])
+					return false;
+			return true;
+		}());
+}
+
+std::optional<token_t> Interpreter::builtin_ge(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t>)
+{
+	if (args.size() < 2)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"> takes 2 or more args", token);
+		return token_t{};
+	}
+	return token_t::make_bool(
+		[this, &args, &token]()
+		{
+			for (size_t i{0}; i < args.size() - 1; i++)
+			{
+				if (args[i].type != TOKEN_TYPE::INT &&
+					args[i + 1].type != TOKEN_TYPE::INT)
+				{
+					err_.emplace_back(
+						EvalError::Exception::INVALID_ARG_TYPES,
+						L"> takes arg types: int int int...", token);
+					return false;
+				}
+				if (args[i] < args[i + 1])
+					return false;
+			}
+			return true;
+		}());
+}
+
+std::optional<token_t> Interpreter::builtin_gt(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t>)
+{
+	if (args.size() < 2)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"> takes 2 or more args", token);
+		return token_t{};
+	}
+	return token_t::make_bool(
+		[this, &args, &token]()
+		{
+			for (size_t i{0}; i < args.size() - 1; i++)
+			{
+				if (args[i].type != TOKEN_TYPE::INT &&
+					args[i + 1].type != TOKEN_TYPE::INT)
+				{
+					err_.emplace_back(
+						EvalError::Exception::INVALID_ARG_TYPES,
+						L"> takes arg types: int int int...", token);
+					return false;
+				}
+				if (args[i] <= args[i + 1])
+					return false;
+			}
+			return true;
+		}());
+}
+
+std::optional<token_t> Interpreter::builtin_le(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t>)
+{
+	if (args.size() < 2)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"< takes 2 or more args", token);
+		return token_t{};
+	}
+	return token_t::make_bool(
+		[this, &args, &token]()
+		{
+			for (size_t i{0}; i < args.size() - 1; i++)
+			{
+				if (args[i].type != TOKEN_TYPE::INT &&
+					args[i + 1].type != TOKEN_TYPE::INT)
+				{
+					err_.emplace_back(
+						EvalError::Exception::INVALID_ARG_TYPES,
+						L"< takes arg types: int int int...", token);
+					return false;
+				}
+				if (args[i] > args[i + 1])
+					return false;
+			}
+			return true;
+		}());
+}
+
+std::optional<token_t> Interpreter::builtin_lt(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t>)
+{
+	if (args.size() < 2)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"< takes 2 or more args", token);
+		return token_t{};
+	}
+	return token_t::make_bool(
+		[this, &args, &token]()
+		{
+			for (size_t i{0}; i < args.size() - 1; i++)
+			{
+				if (args[i].type != TOKEN_TYPE::INT &&
+					args[i + 1].type != TOKEN_TYPE::INT)
+				{
+					err_.emplace_back(
+						EvalError::Exception::INVALID_ARG_TYPES,
+						L"< takes arg types: int int int...", token);
+					return false;
+				}
+				if (args[i] >= args[i + 1])
+					return false;
+			}
+			return true;
+		}());
+}
+
+std::optional<token_t> Interpreter::builtin_and(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t>)
+{
+	if (args.size() < 2)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"and takes 2 or more args", token);
+		return token_t{};
+	}
+	return token_t::make_bool(
+		[this, &args, &token]()
+		{
+			for (size_t i{0}; i < args.size() - 1; i++)
+			{
+				if (args[i].type != TOKEN_TYPE::BOOL &&
+					args[i + 1].type != TOKEN_TYPE::BOOL)
+				{
+					err_.emplace_back(
+						EvalError::Exception::INVALID_ARG_TYPES,
+						L"and takes arg types: bool bool bool...", token);
+					return false;
+				}
+				if (!(args[i].is_true && args[i + 1].is_true))
+					return false;
+			}
+			return true;
+		}());
+}
+
+std::optional<token_t> Interpreter::builtin_or(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t>)
+{
+	if (args.size() < 2)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"or takes 2 or more args", token);
+		return token_t{};
+	}
+	return token_t::make_bool(
+		[this, &args, &token]()
+		{
+			for (auto& i : args)
+			{
+				if (i.type != TOKEN_TYPE::BOOL)
+				{
+					err_.emplace_back(
+						EvalError::Exception::INVALID_ARG_TYPES,
+						L"or takes arg types: bool bool bool...", token);
+					return false;
+				}
+				if (i.is_true)
+					return true;
+			}
+			return false;
+		}());
+}
+
+std::optional<token_t> Interpreter::builtin_not(
+	const token_t& token,
+	const token_t&,
+	std::vector<token_t>& args,
+	std::weak_ptr<env_t>)
+{
+	if (args.size() != 1)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_NUMBER_OF_ARGS,
+						  L"not takes 1 arg", token);
+		return token_t{};
+	}
+	if (args[0].type != TOKEN_TYPE::BOOL)
+	{
+		err_.emplace_back(EvalError::Exception::INVALID_ARG_TYPES,
+						  L"not takes arg types: bool", token);
+		return token_t{};
+	}
+	return token_t::make_bool(!args[0].is_true);
 }
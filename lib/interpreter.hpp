@@ -1,8 +1,17 @@
 #pragma once
+#include <filesystem>
+#include <functional>
+#include <istream>
 #include <memory>
 #include <span>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
+#include "heap.hpp"
+#include "memo.hpp"
+#include "pool.hpp"
 #include "structs.hpp"
 
 // A list of possible errors that can occur during evaluation
@@ -21,6 +30,8 @@ public:
 		DIVIDE_BY_ZERO,
 		EVAL_EMPTY_LIST,
 		MATH_ERR,
+		MAX_DEPTH,
+		LOAD,
 		QUIT,
 		NONE,
 	};
@@ -39,26 +50,28 @@ public:
 	// There are a ton of different ways to constuct an evaluation error, they
 	// are all listed here
 	EvalError(Exception e, token_t token)
-		: err_{e}, token_{token}, err_msg_{L""} {};
+		: err_{e}, token_{std::move(token)}, err_msg_{L""} {};
 
 	EvalError(Exception e, token_t token, std::shared_ptr<env_t> env)
-		: err_{e}, token_{token}, env_{env}, err_msg_{L""} {};
+		: err_{e}, token_{std::move(token)}, env_{std::move(env)},
+		  err_msg_{L""} {};
 
 	EvalError(Exception e, std::wstring err_msg, token_t token)
-		: err_{e}, token_{token}, err_msg_{err_msg} {};
+		: err_{e}, token_{std::move(token)}, err_msg_{std::move(err_msg)} {};
 
 	EvalError(Exception e,
 			  std::wstring err_msg,
 			  token_t token,
 			  std::shared_ptr<env_t> env)
-		: err_{e}, token_{token}, env_{env}, err_msg_{err_msg} {};
+		: err_{e}, token_{std::move(token)}, env_{std::move(env)},
+		  err_msg_{std::move(err_msg)} {};
 
-	auto get_env()
+	const std::shared_ptr<env_t>& get_env() const
 	{
 		return env_;
 	};
 
-	auto get_token()
+	const token_t& get_token() const
 	{
 		return token_;
 	};
@@ -77,6 +90,8 @@ public:
 			return L"division by 0";
 		case Exception::MATH_ERR:
 			return L"arithmatic with a non INT type";
+		case Exception::MAX_DEPTH:
+			return L"Maximum evaluation depth exceeded";
 		case Exception::NOT_A_FUNCTION:
 			return L"Attempted to evaluate a non-function";
 		case Exception::NOTREACHABLE:
@@ -89,45 +104,232 @@ public:
 			return L"You can't evaluate an empty list silly goose";
 		case Exception::INVALID_NUMBER_OF_ARGS:
 		case Exception::INVALID_ARG_TYPES:
+		case Exception::LOAD:
 			return err_msg_.c_str();
 		}
 		return L"tf did you do?";
 	};
 };
 
-// Singelton for the interpreter, can be called from anywhere, stores its
-// envirionment
+// The engines an interpreter can evaluate with, both share the environment and
+// report the same errors
+enum class ENGINE : uint8_t
+{
+	// walks the token tree directly
+	TREE,
+	// compiles each form to bytecode and runs it on a stack VM
+	BYTECODE,
+};
+
+struct chunk_t;
+
+// The names of the special forms, interned up front so both engines recognise
+// them with an integer compare
+inline const symbol_t kQUIT{SymbolTable::intern(L"quit")};
+inline const symbol_t kIF{SymbolTable::intern(L"if")};
+inline const symbol_t kDEFINE{SymbolTable::intern(L"define")};
+inline const symbol_t kSET{SymbolTable::intern(L"set!")};
+inline const symbol_t kDEFUN{SymbolTable::intern(L"defun")};
+inline const symbol_t kLAMBDA{SymbolTable::intern(L"lambda")};
+inline const symbol_t kFUNCALL{SymbolTable::intern(L"funcall")};
+inline const symbol_t kLOAD{SymbolTable::intern(L"load")};
+
+// The interpreter, stores its envirionment. Every instance has its own global
+// environment, errors and heap, they share nothing but the interned symbols
+// and the builtins, which never change. So different instances can evaluate
+// on different threads at the same time, a single instance can only be used
+// from one thread at a time
 class Interpreter
 {
 private:
 	// The process of evaluating an expression in  LISP is inheriently recursive
-	// so we share the err member across the whole class.
+	// so we share the err member across the whole instance.
 	// if there is an error the user has to explicitly ask for its value
-	static std::vector<EvalError> err_;
+	std::vector<EvalError> err_{};
 
 	// The global environment
-	static std::shared_ptr<env_t> env_;
-	static Interpreter* pinstance_;
-	static std::mutex mutex_;
+	std::shared_ptr<env_t> env_;
+
+	// watches the closures and lists made while evaluating for cycles
+	Heap heap_{};
+
+	ENGINE engine_{ENGINE::TREE};
+
+	// Activation frames that no one references anymore, every call takes its
+	// frame from here so recursion doesn't allocate a new one each time
+	std::vector<std::shared_ptr<env_t>> frame_pool_{};
+	static constexpr size_t kMAX_POOLED_FRAMES{256};
+	// The same for the argument lists builtins are called with
+	std::vector<std::vector<token_t>> args_pool_{};
+	static constexpr size_t kMAX_POOLED_ARGS{256};
+
+	// How deep evaluation may nest before it's abandoned with a MAX_DEPTH
+	// error, counts the forms being evaluated and the VM's call frames
+	size_t max_depth_{kDEFAULT_MAX_DEPTH};
+	size_t depth_{};
+	// the deepest depth_ got since the memoized call being evaluated started
+	size_t peak_{};
+	// set once the depth limit was hit, everything still being evaluated
+	// returns straight away and the errors raised while unwinding are dropped
+	bool aborted_{};
+	size_t abort_at_{};
+	// set once the tree walker ran out of depth, until walk unwinds to the
+	// call whose body it was in and reports the error with that call
+	bool blame_call_{};
+
+	// A call in tail position a special form leaves for walk to evaluate,
+	// instead of recursing into walk itself. The expression is evaluated in
+	// the environment the special form was called in
+	struct tail_t
+	{
+		// keeps expr alive when it isn't part of the calling form
+		std::shared_ptr<const token_t> owner;
+		const token_t* expr;
+		// the call expr stands in for, a lambda it calls that goes too deep
+		// is reported with it
+		std::optional<token_t> call{};
+	};
+	std::optional<tail_t> tail_{};
+
+	// bumped whenever a global is defined or set, whatever was worked out
+	// from the globals before may be stale once it changes
+	size_t version_{};
+
+	// The builtins and special forms fold relied on in the bodies it changed,
+	// and whether one of them was defined over since. The bodies then run as
+	// they were written, and nothing is folded anymore
+	std::unordered_set<symbol_t> folded_{};
+	bool unfolded_{};
+
+	// The results of calls to pure recursive functions, and whether calls to
+	// a function go through it. Both are forgotten once the globals change,
+	// version_ is what they were filled at
+	MemoTable memo_{};
+	std::unordered_map<const object_t*, std::pair<token_t, bool>> memoize_{};
+	size_t memo_version_{};
+	// set for the walk of a memoized body, see walk
+	bool body_walk_{};
 
-protected:
-	Interpreter(){};
-	~Interpreter(){};
+	// The interpreters the workers of the pool evaluate with, they share this
+	// ones global environment and heap. A worker has parent_ set, its own
+	// parallel builtins run sequentially
+	std::vector<std::unique_ptr<Interpreter>> workers_{};
+	Interpreter* parent_{};
+	// the pool the parallel builtins run on, started the first time one does
+	// and stopped before the workers go away
+	std::unique_ptr<WorkPool> pool_{};
+	// how many workers the pool gets, 0 for one per core
+	size_t threads_{};
+
+	// a worker of parent's pool
+	explicit Interpreter(Interpreter* parent);
 
 public:
+	Interpreter();
+
 	Interpreter(Interpreter& other) = delete;
 	void operator=(Interpreter& other) = delete;
 
+	/**
+	 * @brief a process wide instance, made on first use. For code that
+	 *doesn't need an interpreter of its own
+	 **/
 	static Interpreter* getInstance();
 
 	// evaluates the given token
 	/**
-	 * @brief evaluates the given token in the supplied envrionment
-	 * environment is defaulted to the global environment
+	 * @brief evaluates the given token in the supplied envrionment with the
+	 *selected engine, environment is defaulted to the global environment
+	 **/
+	token_t eval(const token_t& token, std::weak_ptr<env_t> env);
+
+	token_t eval(const token_t& token)
+	{
+		return eval(token, env_);
+	}
+
+	/**
+	 * @brief evaluates every form read from in, each one as soon as it has
+	 *been read so memory use is bounded by the biggest form instead of the
+	 *whole input. Stops at the first parse or evaluation error
+	 * @return the value of the last form
+	 **/
+	token_t load(std::istream& in, std::weak_ptr<env_t> env);
+
+	token_t load(std::istream& in)
+	{
+		return load(in, env_);
+	}
+
+	/**
+	 * @brief load for the file at path, raises a LOAD error when it can't be
+	 *opened
+	 **/
+	token_t load(const std::filesystem::path& path, std::weak_ptr<env_t> env);
+
+	token_t load(const std::filesystem::path& path)
+	{
+		return load(path, env_);
+	}
+
+	static constexpr size_t kDEFAULT_MAX_DEPTH{2000};
+	// Forms are resolved and compiled recursively, nesting deeper than this
+	// fails whatever the depth limit is
+	static constexpr size_t kMAX_NESTING{4000};
+
+	/**
+	 * @brief sets how deep evaluation may nest, forms nested deeper and calls
+	 *recursing deeper fail with a MAX_DEPTH error instead of overflowing the
+	 *stack. The tree walker recurses on the native stack, it fails the same
+	 *way once that is nearly used up even if the limit isn't reached. Only
+	 *the bytecode engine can make use of a limit much above the default
+	 **/
+	void set_max_depth(size_t max_depth)
+	{
+		max_depth_ = max_depth;
+	}
+
+	size_t get_max_depth()
+	{
+		return max_depth_;
+	}
+
+	void set_engine(ENGINE engine)
+	{
+		engine_ = engine;
+	}
+
+	ENGINE get_engine()
+	{
+		return engine_;
+	}
+
+	/**
+	 * @brief how many threads the parallel builtins may use, this one
+	 *included. 0 uses one per core
 	 **/
-	token_t eval(const token_t& token, std::weak_ptr<env_t> env = env_);
+	void set_threads(size_t threads)
+	{
+		threads_ = threads;
+		pool_.reset();
+		workers_.clear();
+	}
 
-	std::vector<EvalError> get_error()
+	/**
+	 * @brief how many results of pure recursive functions are remembered, 0
+	 *turns memoization off
+	 **/
+	void set_memo_size(size_t size)
+	{
+		memo_.set_capacity(size);
+		for (auto& i : workers_)
+			i->memo_.set_capacity(size);
+	}
+
+	// the memo tables of this interpreter and its workers, added up
+	memo_stats_t get_memo_stats();
+
+	const std::vector<EvalError>& get_error() const
 	{
 		return err_;
 	};
@@ -143,34 +345,324 @@ public:
 		return env_;
 	}
 
+	heap_stats_t get_heap_stats()
+	{
+		return heap_.stats();
+	}
+
 private:
 	/**
-	 * @brief a collection of default (non-user) functions, this calls special
-	 *functions first
-	 * @param token the list token that called this function
-	 * @param func The first symbol in the list, the funciton that gets
-	 *evaluated
-	 * @param args the rest of the variables for the function
-	 * @param env the current environment the function is to be evaluated in
+	 * @brief the tree walking engine, evaluates the token directly. Calls in
+	 *tail position of if, funcall and lambda bodies are looped on rather than
+	 *recursed into
 	 **/
-	std::optional<token_t> default_functions(
-		const token_t& token,
-		const token_t& func,
-		const std::span<const token_t> args,
-		std::weak_ptr<env_t> env);
+	token_t walk(const token_t& form, std::weak_ptr<env_t> env);
+
+	/**
+	 * @brief raises MAX_DEPTH and abandons the evaluation that's running
+	 **/
+	void exceed_depth(const token_t& token);
+
+	/**
+	 * @brief whether the form nests deeper than the depth limit or
+	 *kMAX_NESTING, checked before evaluating so the compiler and resolve
+	 *never recurse too deep
+	 **/
+	bool too_deep(const token_t& form) const;
+
+	/**
+	 * @brief whether the native stack of the calling thread is close to
+	 *running out, what stops the tree walker when the depth limit is more
+	 *than the stack holds
+	 **/
+	static bool stack_exhausted();
+
+	/**
+	 * @brief the binding a symbol was resolved to, see resolve. nullptr if it
+	 *is unbound. The binding is not copied, it stays good until the next
+	 *define or a new frame is bound
+	 **/
+	token_t* lookup(const token_t& symbol, env_t& env);
+	// lookup, but a GLOBAL symbol doesn't need the frame locked
+	token_t* lookup(const token_t& symbol, const std::weak_ptr<env_t>& env);
+
+	/**
+	 * @brief creates the frame of a lambda, its arguments start out bound to
+	 *themselves. The lambda keeps this frame as the template every call copies
+	 *its activation frame from
+	 * @param params the list of argument symbols
+	 * @param next the environment the lambda was created in
+	 **/
+	std::shared_ptr<env_t> make_frame(const token_t& params,
+									  std::shared_ptr<env_t> next);
 
 	/**
-	 * @brief performs special functions, i.e if, funcall, lambda, define
-	 *etc
+	 * @brief a fresh activation frame for a single call, a copy of the lambdas
+	 *frame taken from the frame pool
+	 * @param proto the frame the lambda was created with
+	 **/
+	std::shared_ptr<env_t> acquire_frame(const env_t& proto);
+
+	/**
+	 * @brief hands the frame of a finished call back to the pool, unless
+	 *something like a closure still holds on to it
+	 **/
+	void release_frame(std::shared_ptr<env_t> frame);
+
+	// an empty argument list for a builtin call, from the pool if it has one
+	std::vector<token_t> acquire_args();
+	// hands the arguments of a finished builtin call back to the pool
+	void release_args(std::vector<token_t> args);
+
+	/**
+	 * @brief annotates every symbol a lambda body evaluates with its frame
+	 *depth and slot, or marks it global. Nested lambda bodies are left alone,
+	 *they are resolved when they are created
+	 * @param token the body, or a part of it
+	 * @param scope the frame of the lambda being created
+	 **/
+	void resolve(token_t& token, const env_t& scope);
+
+	/**
+	 * @brief folds the calls to pure builtins in lambda and defun bodies whose
+	 *args are all constants into their value, and the ifs whose test is a
+	 *constant into the branch taken. A call that would raise an error is left
+	 *to raise it when it runs
+	 * @param token the form, or a part of it
+	 * @param scopes the arguments of the lambdas token is in, a call to one of
+	 *those isn't a call to a builtin. Empty outside of a body
+	 * @return the folded form, nothing if it didn't change. A body it changed
+	 *becomes (folded written), see special_folded
+	 **/
+	std::optional<token_t> fold(const token_t& token,
+								std::vector<std::span<const token_t>>& scopes);
+
+	/**
+	 * @brief whether calling fn only computes a value, without defining,
+	 *setting, loading or printing anything. Calls it can't see through, like
+	 *one to a lambda passed in as an argument, count as impure
+	 **/
+	bool pure(const token_t& fn);
+
+	// a global was defined or set
+	void changed_global(symbol_t name);
+
+	// whether the folded bodies run as they were written, see folded_
+	bool unfolded() const
+	{
+		return parent_ ? parent_->unfolded_ : unfolded_;
+	}
+
+	/**
+	 * @brief the memo table calls of fn go through, nullptr if they don't.
+	 *Only functions made by defun that are pure and can call themselves are
+	 *memoized, worked out the first time one is called after the globals last
+	 *changed
+	 **/
+	MemoTable* memo_for(const token_t& fn);
+
+	/**
+	 * @brief the pool, started along with its worker interpreters if it
+	 *wasn't yet
+	 **/
+	WorkPool& pool();
+
+	/**
+	 * @brief calls task with an interpreter and every index below count. On
+	 *the pool and worker interpreters when parallel, otherwise in order on
+	 *this one. The errors raised end up in err_ in the order of the indices,
+	 *the same as when they run one after the other
+	 **/
+	void for_each_index(size_t count,
+						bool parallel,
+						const std::function<void(Interpreter&, size_t)>& task);
+
+	/**
+	 * @brief the bytecode engine, runs a compiled chunk in the given
+	 *environment. Defined in vm.cpp
+	 **/
+	token_t execute(const chunk_t& chunk, std::shared_ptr<env_t> env);
+
+public:
+	// A builtin or special form, special forms get their args unevaluated,
+	// builtins get them evaluated
+	struct builtin_t
+	{
+		using special_fn =
+			std::optional<token_t> (Interpreter::*)(const token_t&,
+													const token_t&,
+													std::span<const token_t>,
+													std::weak_ptr<env_t>);
+		using builtin_fn =
+			std::optional<token_t> (Interpreter::*)(const token_t&,
+													const token_t&,
+													std::vector<token_t>&,
+													std::weak_ptr<env_t>);
+
+		symbol_t name;
+		special_fn special{};
+		builtin_fn builtin{};
+		// only computes a value from its args, a call with constant args
+		// can be folded into its value
+		bool pure{};
+	};
+
+	/**
+	 * @brief the builtin or special form called name, nullptr if there is
+	 *none. This is an array lookup indexed by the symbol id
+	 **/
+	static const builtin_t* find_builtin(symbol_t name);
+
+private:
+	/**
+	 * @brief calls a default (non-user) function, the special form first and
+	 *then the builtin on the evaluated args
 	 * @param token the list token that called this function
 	 * @param func The first symbol in the list, the funciton that gets
 	 *evaluated
+	 * @param builtin what func names in the registry, may be nullptr
 	 * @param args the rest of the variables for the function
 	 * @param env the current environment the function is to be evaluated in
 	 **/
-	std::optional<token_t> special_functions(
+	std::optional<token_t> default_functions(
 		const token_t& token,
 		const token_t& func,
-		std::span<const token_t> args,
+		const builtin_t* builtin,
+		const std::span<const token_t> args,
 		std::weak_ptr<env_t> env);
+
+	// The special forms, i.e if, funcall, lambda, define etc. They return an
+	// empty optional when they couldn't run
+	std::optional<token_t> special_quit(const token_t& token,
+										const token_t& func,
+										std::span<const token_t> args,
+										std::weak_ptr<env_t> env);
+	std::optional<token_t> special_if(const token_t& token,
+									  const token_t& func,
+									  std::span<const token_t> args,
+									  std::weak_ptr<env_t> env);
+	std::optional<token_t> special_define(const token_t& token,
+										  const token_t& func,
+										  std::span<const token_t> args,
+										  std::weak_ptr<env_t> env);
+	std::optional<token_t> special_set(const token_t& token,
+									   const token_t& func,
+									   std::span<const token_t> args,
+									   std::weak_ptr<env_t> env);
+	std::optional<token_t> special_defun(const token_t& token,
+										 const token_t& func,
+										 std::span<const token_t> args,
+										 std::weak_ptr<env_t> env);
+	std::optional<token_t> special_folded(const token_t& token,
+										  const token_t& func,
+										  std::span<const token_t> args,
+										  std::weak_ptr<env_t> env);
+	std::optional<token_t> special_lambda(const token_t& token,
+										  const token_t& func,
+										  std::span<const token_t> args,
+										  std::weak_ptr<env_t> env);
+	std::optional<token_t> special_funcall(const token_t& token,
+										   const token_t& func,
+										   std::span<const token_t> args,
+										   std::weak_ptr<env_t> env);
+	std::optional<token_t> special_load(const token_t& token,
+										const token_t& func,
+										std::span<const token_t> args,
+										std::weak_ptr<env_t> env);
+
+	// The builtins, they get their args already evaluated
+	std::optional<token_t> builtin_print(const token_t& token,
+										 const token_t& func,
+										 std::vector<token_t>& args,
+										 std::weak_ptr<env_t> env);
+	std::optional<token_t> builtin_mapcar(const token_t& token,
+										  const token_t& func,
+										  std::vector<token_t>& args,
+										  std::weak_ptr<env_t> env);
+	// The parallel ones split the list over the pool, as long as the function
+	// is pure and the list long enough to be worth it
+	std::optional<token_t> builtin_pmapcar(const token_t& token,
+										   const token_t& func,
+										   std::vector<token_t>& args,
+										   std::weak_ptr<env_t> env);
+	std::optional<token_t> builtin_pfilter(const token_t& token,
+										   const token_t& func,
+										   std::vector<token_t>& args,
+										   std::weak_ptr<env_t> env);
+	std::optional<token_t> builtin_preduce(const token_t& token,
+										   const token_t& func,
+										   std::vector<token_t>& args,
+										   std::weak_ptr<env_t> env);
+	std::optional<token_t> builtin_car(const token_t& token,
+									   const token_t& func,
+									   std::vector<token_t>& args,
+									   std::weak_ptr<env_t> env);
+	std::optional<token_t> builtin_cdr(const token_t& token,
+									   const token_t& func,
+									   std::vector<token_t>& args,
+									   std::weak_ptr<env_t> env);
+	std::optional<token_t> builtin_cons(const token_t& token,
+										const token_t& func,
+										std::vector<token_t>& args,
+										std::weak_ptr<env_t> env);
+	std::optional<token_t> builtin_sqrt(const token_t& token,
+										const token_t& func,
+										std::vector<token_t>& args,
+										std::weak_ptr<env_t> env);
+	std::optional<token_t> builtin_pow(const token_t& token,
+									   const token_t& func,
+									   std::vector<token_t>& args,
+									   std::weak_ptr<env_t> env);
+	std::optional<token_t> builtin_add(const token_t& token,
+									   const token_t& func,
+									   std::vector<token_t>& args,
+									   std::weak_ptr<env_t> env);
+	std::optional<token_t> builtin_sub(const token_t& token,
+									   const token_t& func,
+									   std::vector<token_t>& args,
+									   std::weak_ptr<env_t> env);
+	std::optional<token_t> builtin_mul(const token_t& token,
+									   const token_t& func,
+									   std::vector<token_t>& args,
+									   std::weak_ptr<env_t> env);
+	std::optional<token_t> builtin_div(const token_t& token,
+									   const token_t& func,
+									   std::vector<token_t>& args,
+									   std::weak_ptr<env_t> env);
+	std::optional<token_t> builtin_eq(const token_t& token,
+									  const token_t& func,
+									  std::vector<token_t>& args,
+									  std::weak_ptr<env_t> env);
+	std::optional<token_t> builtin_ne(const token_t& token,
+									  const token_t& func,
+									  std::vector<token_t>& args,
+									  std::weak_ptr<env_t> env);
+	std::optional<token_t> builtin_ge(const token_t& token,
+									  const token_t& func,
+									  std::vector<token_t>& args,
+									  std::weak_ptr<env_t> env);
+	std::optional<token_t> builtin_gt(const token_t& token,
+									  const token_t& func,
+									  std::vector<token_t>& args,
+									  std::weak_ptr<env_t> env);
+	std::optional<token_t> builtin_le(const token_t& token,
+									  const token_t& func,
+									  std::vector<token_t>& args,
+									  std::weak_ptr<env_t> env);
+	std::optional<token_t> builtin_lt(const token_t& token,
+									  const token_t& func,
+									  std::vector<token_t>& args,
+									  std::weak_ptr<env_t> env);
+	std::optional<token_t> builtin_and(const token_t& token,
+									   const token_t& func,
+									   std::vector<token_t>& args,
+									   std::weak_ptr<env_t> env);
+	std::optional<token_t> builtin_or(const token_t& token,
+									  const token_t& func,
+									  std::vector<token_t>& args,
+									  std::weak_ptr<env_t> env);
+	std::optional<token_t> builtin_not(const token_t& token,
+									   const token_t& func,
+									   std::vector<token_t>& args,
+									   std::weak_ptr<env_t> env);
 };
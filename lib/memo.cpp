@@ -0,0 +1,178 @@
+#include "memo.hpp"
+
+#include <functional>
+#include <utility>
+
+namespace
+{
+void Combine(size_t &hash, size_t value)
+{
+	hash ^= value + 0x9E3779B97F4A7C15 + (hash << 6) + (hash >> 2);
+}
+
+// Hashes the tokens the way Same compares them, lists by their elements and
+// lambdas by their object. Kept on the heap so deeply nested lists can't
+// overflow the stack
+size_t Hash(const token_t &fn, std::span<const token_t> args)
+{
+	size_t hash{std::hash<const void *>{}(fn.object.get())};
+	std::vector<const token_t *> tokens{};
+	for (size_t i{args.size()}; i > 0; i--)
+		tokens.push_back(&args[i - 1]);
+
+	while (!tokens.empty())
+	{
+		const token_t &token{*tokens.back()};
+		tokens.pop_back();
+		Combine(hash, static_cast<size_t>(token.type) << 1 | token.quoted);
+		switch (token.type)
+		{
+		case TOKEN_TYPE::LIST:
+			Combine(hash, token.apval().size());
+			for (size_t i{token.apval().size()}; i > 0; i--)
+				tokens.push_back(&token.apval()[i - 1]);
+			break;
+		case TOKEN_TYPE::INT:
+			// big ints are rare enough as arguments to hash by their digits
+			if (token.big())
+				Combine(hash,
+						std::hash<std::wstring>{}(token.big()->to_string()));
+			else
+				Combine(hash, std::hash<int64_t>{}(token.val));
+			break;
+		case TOKEN_TYPE::BOOL:
+			Combine(hash, token.is_true);
+			break;
+		case TOKEN_TYPE::LAMBDA:
+			Combine(hash, std::hash<const void *>{}(token.object.get()));
+			break;
+		case TOKEN_TYPE::SYMBOL:
+		case TOKEN_TYPE::DELIM:
+			Combine(hash, token.pname);
+			break;
+		}
+	}
+	return hash;
+}
+
+bool Same(std::span<const token_t> l, std::span<const token_t> r)
+{
+	std::vector<std::pair<std::span<const token_t>, std::span<const token_t>>>
+		lists{{l, r}};
+	while (!lists.empty())
+	{
+		auto [l, r]{lists.back()};
+		lists.pop_back();
+		if (l.size() != r.size())
+			return false;
+		for (size_t i{0}; i < l.size(); i++)
+		{
+			if (l[i].type != r[i].type || l[i].quoted != r[i].quoted)
+				return false;
+			switch (l[i].type)
+			{
+			case TOKEN_TYPE::LIST:
+				lists.emplace_back(l[i].apval(), r[i].apval());
+				break;
+			case TOKEN_TYPE::LAMBDA:
+				if (l[i].object.get() != r[i].object.get())
+					return false;
+				break;
+			default:
+				if (l[i] != r[i])
+					return false;
+				break;
+			}
+		}
+	}
+	return true;
+}
+}  // namespace
+
+const MemoTable::result_t *
+MemoTable::find(const token_t &fn, std::span<const token_t> args, size_t room)
+{
+	auto entry{lookup(Hash(fn, args), fn, args)};
+	if (entry == lru_.end() || entry->result.depth > room)
+	{
+		misses_++;
+		return nullptr;
+	}
+	hits_++;
+	lru_.splice(lru_.begin(), lru_, entry);
+	return &entry->result;
+}
+
+void MemoTable::insert(const token_t &fn,
+					   std::span<const token_t> args,
+					   result_t result)
+{
+	if (!capacity_)
+		return;
+
+	const size_t hash{Hash(fn, args)};
+	// a call of the function that is still running can have put it in first
+	if (auto entry{lookup(hash, fn, args)}; entry != lru_.end())
+	{
+		entry->result = std::move(result);
+		lru_.splice(lru_.begin(), lru_, entry);
+		return;
+	}
+
+	if (lru_.size() >= capacity_)
+	{
+		drop_last();
+		evictions_++;
+	}
+
+	lru_.push_front(entry_t{.hash = hash,
+							.fn = fn,
+							.args{args.begin(), args.end()},
+							.result = std::move(result)});
+	index_.emplace(hash, lru_.begin());
+}
+
+void MemoTable::clear()
+{
+	index_.clear();
+	lru_.clear();
+}
+
+void MemoTable::set_capacity(size_t capacity)
+{
+	capacity_ = capacity;
+	while (lru_.size() > capacity_)
+		drop_last();
+}
+
+void MemoTable::drop_last()
+{
+	auto [first, last]{index_.equal_range(lru_.back().hash)};
+	for (auto i{first}; i != last; i++)
+		if (i->second == std::prev(lru_.end()))
+		{
+			index_.erase(i);
+			break;
+		}
+	lru_.pop_back();
+}
+
+memo_stats_t MemoTable::stats() const
+{
+	return memo_stats_t{.hits = hits_,
+						.misses = misses_,
+						.evictions = evictions_,
+						.entries = lru_.size()};
+}
+
+MemoTable::lru_t::iterator MemoTable::lookup(size_t hash,
+											 const token_t &fn,
+											 std::span<const token_t> args)
+{
+	auto [first, last]{index_.equal_range(hash)};
+	for (auto i{first}; i != last; i++)
+		if (i->second->fn.object.get() == fn.object.get() &&
+			Same(i->second->args, args))
+			return i->second;
+	return lru_.end();
+}
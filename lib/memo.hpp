@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+#include "structs.hpp"
+
+// What a MemoTable has done so far
+struct memo_stats_t
+{
+	// calls answered from the table and calls that had to be evaluated
+	size_t hits{};
+	size_t misses{};
+	// results dropped to make room for newer ones
+	size_t evictions{};
+	// results held right now
+	size_t entries{};
+};
+
+// The results of calls to pure functions, keyed by the function and the
+// values it was called with. It holds at most capacity results, the one used
+// least recently makes room for a new one. Two keys are the same when their
+// values are structurally equal, except lambdas which have to be the same
+// lambda since equal bodies can close over different environments
+class MemoTable
+{
+public:
+	// off unless asked for, looking a call up costs more than most calls
+	// whose arguments never repeat save
+	static constexpr size_t kDEFAULT_CAPACITY{0};
+
+	struct result_t
+	{
+		token_t value;
+		// how much deeper than the call evaluating it went, a result is only
+		// reused where evaluating it again wouldn't hit the depth limit
+		size_t depth;
+	};
+
+	explicit MemoTable(size_t capacity = kDEFAULT_CAPACITY)
+		: capacity_{capacity} {};
+
+	MemoTable(const MemoTable &) = delete;
+	void operator=(const MemoTable &) = delete;
+
+	/**
+	 * @brief the result of an earlier call of fn with args, nullptr if there
+	 *is none or it went more than room deeper. Counts as a hit or a miss
+	 **/
+	const result_t *find(const token_t &fn,
+						 std::span<const token_t> args,
+						 size_t room);
+
+	/**
+	 * @brief remembers the result of calling fn with args, evicting the least
+	 *recently used result when the table is full
+	 **/
+	void insert(const token_t &fn,
+				std::span<const token_t> args,
+				result_t result);
+
+	// forgets every result, the counters are kept
+	void clear();
+
+	// 0 turns memoization off
+	void set_capacity(size_t capacity);
+
+	size_t capacity() const
+	{
+		return capacity_;
+	}
+
+	memo_stats_t stats() const;
+
+private:
+	struct entry_t
+	{
+		size_t hash;
+		// holding on to the function keeps its address from being reused by
+		// another one while the result is here
+		token_t fn;
+		std::vector<token_t> args;
+		result_t result;
+	};
+
+	// most recently used first
+	using lru_t = std::list<entry_t>;
+
+	lru_t lru_{};
+	std::unordered_multimap<size_t, lru_t::iterator> index_{};
+	size_t capacity_;
+	size_t hits_{};
+	size_t misses_{};
+	size_t evictions_{};
+
+	// the least recently used result
+	void drop_last();
+	lru_t::iterator lookup(size_t hash,
+						   const token_t &fn,
+						   std::span<const token_t> args);
+};
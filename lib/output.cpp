@@ -0,0 +1,149 @@
+#include "output.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <utility>
+
+namespace
+{
+// Appends c to out as UTF-8, anything that isn't a code point becomes U+FFFD
+void EncodeUtf8(std::string &out, char32_t c)
+{
+	if ((c >= 0xD800 && c <= 0xDFFF) || c > 0x10FFFF)
+		c = 0xFFFD;
+
+	if (c < 0x80)
+		out.push_back(static_cast<char>(c));
+	else if (c < 0x800)
+	{
+		out.push_back(static_cast<char>(0xC0 | c >> 6));
+		out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+	}
+	else if (c < 0x10000)
+	{
+		out.push_back(static_cast<char>(0xE0 | c >> 12));
+		out.push_back(static_cast<char>(0x80 | (c >> 6 & 0x3F)));
+		out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+	}
+	else
+	{
+		out.push_back(static_cast<char>(0xF0 | c >> 18));
+		out.push_back(static_cast<char>(0x80 | (c >> 12 & 0x3F)));
+		out.push_back(static_cast<char>(0x80 | (c >> 6 & 0x3F)));
+		out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+	}
+}
+
+// Writes all of data, a short write just means the rest goes next
+void WriteAll(int fd, std::string_view data)
+{
+	while (!data.empty())
+	{
+		const ssize_t n{::write(fd, data.data(), data.size())};
+		if (n < 0 && errno == EINTR)
+			continue;
+		// nowhere left to report it, the output is lost
+		if (n < 0)
+			return;
+		data.remove_prefix(n);
+	}
+}
+}  // namespace
+
+OutputSink::OutputSink(int fd, FLUSH policy, size_t flush_size)
+	: fd_{fd}, owns_fd_{false}, policy_{policy}, flush_size_{flush_size}
+{
+	writer_ = std::thread{&OutputSink::run, this};
+}
+
+OutputSink::OutputSink(const std::filesystem::path &path,
+					   FLUSH policy,
+					   size_t flush_size)
+	: fd_{::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+				 0644)},
+	  owns_fd_{true},
+	  policy_{policy},
+	  flush_size_{flush_size}
+{
+	writer_ = std::thread{&OutputSink::run, this};
+}
+
+OutputSink::~OutputSink()
+{
+	{
+		std::unique_lock lock{mutex_};
+		if (!buffer_.empty())
+			hand_off(lock);
+		closing_ = true;
+	}
+	cv_.notify_all();
+	writer_.join();
+
+	if (owns_fd_ && ok())
+		::close(fd_);
+}
+
+void OutputSink::write(std::wstring_view str)
+{
+	for (wchar_t c : str)
+		EncodeUtf8(buffer_, static_cast<char32_t>(c));
+
+	if ((policy_ == FLUSH::BYTES && buffer_.size() >= flush_size_) ||
+		buffer_.size() >= kMAX_BUFFER)
+	{
+		std::unique_lock lock{mutex_};
+		hand_off(lock);
+	}
+}
+
+void OutputSink::write_line(std::wstring_view str)
+{
+	write(str);
+	buffer_.push_back('\n');
+
+	if (policy_ == FLUSH::LINE)
+	{
+		std::unique_lock lock{mutex_};
+		hand_off(lock);
+	}
+}
+
+void OutputSink::flush()
+{
+	std::unique_lock lock{mutex_};
+	if (!buffer_.empty())
+		hand_off(lock);
+	cv_.wait(lock, [this]() { return pending_.empty() && !writing_; });
+}
+
+void OutputSink::hand_off(std::unique_lock<std::mutex> &lock)
+{
+	cv_.wait(lock, [this]() { return pending_.size() < kMAX_PENDING; });
+	pending_.push_back(std::exchange(buffer_, {}));
+	// the next buffer starts out as big as the last one
+	buffer_.reserve(pending_.back().size());
+	cv_.notify_all();
+}
+
+void OutputSink::run()
+{
+	std::unique_lock lock{mutex_};
+	while (true)
+	{
+		cv_.wait(lock, [this]() { return !pending_.empty() || closing_; });
+		if (pending_.empty())
+			return;
+
+		std::string data{std::move(pending_.front())};
+		pending_.pop_front();
+		writing_ = true;
+		lock.unlock();
+		if (ok())
+			WriteAll(fd_, data);
+		lock.lock();
+		writing_ = false;
+		cv_.notify_all();
+	}
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+// When an OutputSink hands what it has buffered to its writer
+enum class FLUSH : uint8_t
+{
+	// after every line
+	LINE,
+	// once the buffer holds the sinks flush size
+	BYTES,
+	// only when the sink is closed, or flushed explicitly
+	EXIT,
+};
+
+// Buffers output as UTF-8 and writes it to a file descriptor from a thread of
+// its own, so whoever produces the output never waits on the write. Buffers
+// handed to the writer are queued, the producer only blocks when the writer
+// is kMAX_PENDING buffers behind. Only one thread may write to a sink
+class OutputSink
+{
+public:
+	static constexpr size_t kDEFAULT_FLUSH_SIZE{1 << 16};
+	// even with FLUSH::EXIT a buffer this big is handed off, so memory stays
+	// bounded
+	static constexpr size_t kMAX_BUFFER{1 << 22};
+	static constexpr size_t kMAX_PENDING{4};
+
+	/**
+	 * @brief writes to fd, which is left open
+	 **/
+	explicit OutputSink(int fd,
+						FLUSH policy = FLUSH::BYTES,
+						size_t flush_size = kDEFAULT_FLUSH_SIZE);
+
+	/**
+	 * @brief writes to the file at path, its created or truncated. ok() is
+	 *false when it couldn't be opened
+	 **/
+	explicit OutputSink(const std::filesystem::path &path,
+						FLUSH policy = FLUSH::BYTES,
+						size_t flush_size = kDEFAULT_FLUSH_SIZE);
+
+	// writes whatever is left and waits for the writer to finish
+	~OutputSink();
+
+	OutputSink(const OutputSink &) = delete;
+	void operator=(const OutputSink &) = delete;
+
+	bool ok() const
+	{
+		return fd_ >= 0;
+	}
+
+	void write(std::wstring_view str);
+
+	// writes str and a newline, with FLUSH::LINE the line is handed off
+	void write_line(std::wstring_view str);
+
+	/**
+	 * @brief hands off the buffer and waits until everything written so far
+	 *has reached the file descriptor
+	 **/
+	void flush();
+
+private:
+	// queues the buffer for the writer, waiting if its too far behind
+	void hand_off(std::unique_lock<std::mutex> &lock);
+	void run();
+
+	int fd_;
+	bool owns_fd_;
+	FLUSH policy_;
+	size_t flush_size_;
+
+	std::string buffer_{};
+
+	std::mutex mutex_{};
+	std::condition_variable cv_{};
+	std::deque<std::string> pending_{};
+	// whether the writer is in the middle of writing a buffer
+	bool writing_{};
+	bool closing_{};
+	std::thread writer_{};
+};
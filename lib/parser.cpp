@@ -1,14 +1,66 @@
 #include "parser.hpp"
 
+#include <algorithm>
+#include <climits>
 #include <cstddef>
+#include <cstdint>
+#include <cwctype>
 #include <iterator>
 #include <ranges>
 #include <stack>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 #include "structs.hpp"
 
+namespace
+{
+// What an atom is, an optionally signed run of digits is an INT, T and NIL are
+// BOOLs and anything else is a SYMBOL
+struct atom_t
+{
+	TOKEN_TYPE type{TOKEN_TYPE::SYMBOL};
+	int64_t val{};
+	// an INT too big for an int64_t, its a BigInt
+	bool overflow{};
+};
+
+// Classifies and converts the atom in one pass, without throwing or building
+// a string the way stoi does
+atom_t ScanAtom(std::wstring_view str)
+{
+	if (str == L"T")
+		return {.type = TOKEN_TYPE::BOOL, .val = 1};
+	if (str == L"NIL")
+		return {.type = TOKEN_TYPE::BOOL};
+
+	bool negative{str.starts_with(L'-')};
+	if (negative || str.starts_with(L'+'))
+		str.remove_prefix(1);
+	if (str.empty())
+		return {};
+
+	// one past INT64_MAX fits when its negative, anything further is left to
+	// BigInt
+	const uint64_t limit{uint64_t{INT64_MAX} + negative};
+	uint64_t val{};
+	bool overflow{};
+	for (wchar_t c : str)
+	{
+		if (c < L'0' || c > L'9')
+			return {};
+		if (val > (limit - (c - L'0')) / 10)
+			overflow = true;
+		else
+			val = val * 10 + (c - L'0');
+	}
+	return {.type = TOKEN_TYPE::INT,
+			.val = static_cast<int64_t>(negative ? ~val + 1 : val),
+			.overflow = overflow};
+}
+}  // namespace
+
 std::pair<std::vector<parse_token_t>, ParserError>
 ParsePrintTokens(std::wstring_view input)
 {
@@ -101,7 +153,7 @@ ParsePrintTokens(std::wstring_view input)
 					// copy the rest of the input
 					str = input;
 					input.remove_prefix(input.size());
-					input_pos = input.size() - 1;
+					input_pos += str.size();
 				}
 				else
 				{
@@ -111,43 +163,11 @@ ParsePrintTokens(std::wstring_view input)
 				}
 
 				// Now convert the value to either a symbol an int or a boolean
-				if (str == L"T")
-				{
-					tokens.emplace_back(parse_token_t{.quoted = quoted,
-													  .is_true = true,
-													  .type = TOKEN_TYPE::BOOL,
-													  .pname = str});
-				}
-				else if (str == L"NIL")
-				{
-					tokens.emplace_back(parse_token_t{.quoted = quoted,
-													  .is_true = false,
-													  .type = TOKEN_TYPE::BOOL,
-													  .pname = str});
-				}
-				else
-				{
-					try
-					{
-						size_t pos{};
-						std::stoi(std::wstring{str}, &pos);
-						if (pos != str.size())
-							throw;
-						tokens.emplace_back(
-							parse_token_t{.quoted = quoted,
-										  .type = TOKEN_TYPE::INT,
-										  .pname = str});
-					}
-					catch (...)
-					{
-						// TODO: tell the user when its an overflow
-						//  not convertable to an integer
-						tokens.emplace_back(
-							parse_token_t{.quoted = quoted,
-										  .type = TOKEN_TYPE::SYMBOL,
-										  .pname = str});
-					}
-				}
+				const atom_t atom{ScanAtom(str)};
+				tokens.emplace_back(parse_token_t{.quoted = quoted,
+												  .is_true = atom.val != 0,
+												  .type = atom.type,
+												  .pname = str});
 			}
 		}
 
@@ -155,7 +175,7 @@ ParsePrintTokens(std::wstring_view input)
 }
 
 std::pair<std::vector<token_t>, ParserError>
-ParseEvalTokens(std::wstring_view input)
+ParseEvalTokens(std::wstring_view input, bool use_arena)
 {
 	// Used to keep track where in the input we are
 	// so we can throw errors reasonable error messages on parsing
@@ -165,6 +185,16 @@ ParseEvalTokens(std::wstring_view input)
 	// Store a stack containing the position in the array to the list token, and
 	// the first token in the list
 	std::stack<std::pair<size_t, size_t>> list_stack;
+	// the lists keep the arena alive after the parse lets go of it
+	struct arena_guard_t
+	{
+		Arena *arena;
+		~arena_guard_t()
+		{
+			if (arena)
+				arena->release();
+		}
+	} guard{use_arena ? new Arena{} : nullptr};
 
 	bool quoted;
 
@@ -209,10 +239,10 @@ ParseEvalTokens(std::wstring_view input)
 			if (input.starts_with(L"("))
 			{
 				// Start the list
-				tokens.emplace_back(token_t{
-					.quoted = quoted,
-					.type = TOKEN_TYPE::LIST,
-				});
+				tokens
+					.emplace_back(guard.arena ? token_t::make_list(*guard.arena)
+											  : token_t::make_list({}))
+					.quoted = quoted;
 				// start the list
 				list_stack.emplace(tokens.size() - 1, tokens.size());
 
@@ -238,7 +268,7 @@ ParseEvalTokens(std::wstring_view input)
 					// into the list
 					if (list.second != tokens.size())
 					{
-						tokens[list.first].apval.assign(
+						tokens[list.first].apval_mut().assign(
 							std::make_move_iterator(
 								std::next(tokens.begin(), list.second)),
 							std::make_move_iterator(tokens.end()));
@@ -274,7 +304,7 @@ ParseEvalTokens(std::wstring_view input)
 					// No more delimiting characters found
 					str = input;
 					input.remove_prefix(input.size());
-					input_pos = input.size() - 1;
+					input_pos += str.size();
 				}
 				else
 				{
@@ -284,48 +314,30 @@ ParseEvalTokens(std::wstring_view input)
 				}
 
 				// Now convert the value to either a symbol an int or a boolean
-				if (str == L"T")
+				const atom_t atom{ScanAtom(str)};
+				switch (atom.type)
 				{
+				case TOKEN_TYPE::INT:
+					if (atom.overflow)
+						tokens.push_back(token_t::make_int(BigInt::parse(str)));
+					else
+						tokens.emplace_back(token_t{.val = atom.val,
+													.type = TOKEN_TYPE::INT});
+					tokens.back().quoted = quoted;
+					break;
+				case TOKEN_TYPE::BOOL:
 					tokens.emplace_back(
-						token_t{.quoted = quoted,
-								.is_true = true,
-								.type = TOKEN_TYPE::BOOL,
-								.pname{std::make_shared<std::wstring>(str)}});
-				}
-				else if (str == L"NIL")
-				{
+						token_t{.pname{SymbolTable::intern(str)},
+								.quoted = quoted,
+								.is_true = atom.val != 0,
+								.type = TOKEN_TYPE::BOOL});
+					break;
+				default:
 					tokens.emplace_back(
-						token_t{.quoted = quoted,
-								.is_true = false,
-								.type = TOKEN_TYPE::BOOL,
-								.pname{std::make_shared<std::wstring>(str)}});
-				}
-				else
-				{
-					try
-					{
-						// integer conversion is actual bullshit.
-						size_t pos{};
-						// stoi throws!
-						int x{std::stoi(std::wstring{str}, &pos)};
-						// and so do we >:)
-						if (pos != str.size())
-							throw;
-						tokens.emplace_back(token_t{
-							.val = x,
-							.quoted = quoted,
-							.type = TOKEN_TYPE::INT,
-							.pname{std::make_shared<std::wstring>(str)}});
-					}
-					catch (...)
-					{
-						// TODO: tell the user when its an overflow
-						//  not convertable to an integer
-						tokens.emplace_back(token_t{
-							.quoted = quoted,
-							.type = TOKEN_TYPE::SYMBOL,
-							.pname{std::make_shared<std::wstring>(str)}});
-					}
+						token_t{.pname{SymbolTable::intern(str)},
+								.quoted = quoted,
+								.type = TOKEN_TYPE::SYMBOL});
+					break;
 				}
 			}
 		}
@@ -337,3 +349,213 @@ ParseEvalTokens(std::wstring_view input)
 	}
 	return {tokens, err};
 }
+
+size_t PromptLexer::edit(std::wstring_view buf,
+						 size_t pos,
+						 size_t erased,
+						 size_t inserted)
+{
+	auto end_of = [](const lexed_token_t &token)
+	{ return token.begin + token.size; };
+
+	// The token before the edit can run into the new text, and so can the
+	// one holding the first character after it. Both end at a boundary the
+	// edit didn't touch, so lexing from the start of one to the end of the
+	// other gives what lexing the whole buffer would
+	auto first{std::ranges::partition_point(
+		tokens_, [pos, &end_of](const lexed_token_t &token)
+		{ return end_of(token) < pos; })};
+	auto last{std::ranges::partition_point(
+		first, tokens_.end(),
+		[pos, erased, &end_of](const lexed_token_t &token)
+		{ return end_of(token) <= pos + erased; })};
+	if (last != tokens_.end())
+		last++;
+
+	const size_t begin{first != tokens_.end() ? first->begin : 0};
+	const size_t end{last != tokens_.begin() && last != tokens_.end()
+						 ? end_of(*std::prev(last)) + inserted - erased
+						 : buf.size()};
+	std::vector<lexed_token_t> fresh{};
+	for (size_t i{begin}; i < end;)
+	{
+		size_t size{1};
+		TOKEN_TYPE type{TOKEN_TYPE::DELIM};
+		if (buf[i] == L' ')
+			size = buf.find_first_not_of(L' ', i) - i;
+		else if (buf[i] != L'(' && buf[i] != L')' && buf[i] != L'\'')
+		{
+			size = buf.find_first_of(L"()\' ", i) - i;
+			type = ScanAtom(buf.substr(i, size)).type;
+		}
+		size = std::min(size, buf.size() - i);
+		fresh.push_back({.type = type,
+						 .begin = static_cast<uint>(i),
+						 .size = static_cast<uint>(size)});
+		i += size;
+	}
+
+	for (auto i{last}; i != tokens_.end(); i++)
+		i->begin = i->begin + inserted - erased;
+	const size_t changed{static_cast<size_t>(first - tokens_.begin())};
+	const size_t relexed{changed + fresh.size()};
+	tokens_.insert(tokens_.erase(first, last), fresh.begin(), fresh.end());
+
+	// Carry the paren depth forward, until it's what it already was
+	uint depth{};
+	bool quoted{};
+	if (changed)
+	{
+		const lexed_token_t &prev{tokens_[changed - 1]};
+		depth = prev.depth;
+		if (prev.type == TOKEN_TYPE::DELIM && buf[prev.begin] == L'(')
+			depth++;
+		else if (prev.type == TOKEN_TYPE::DELIM && buf[prev.begin] == L')' &&
+				 depth)
+			depth--;
+		quoted = prev.type == TOKEN_TYPE::DELIM && buf[prev.begin] == L'\'';
+	}
+	for (size_t i{changed}; i < tokens_.size(); i++)
+	{
+		lexed_token_t &token{tokens_[i]};
+		if (i >= relexed && token.depth == depth && token.quoted == quoted)
+			break;
+		token.depth = depth;
+		token.quoted = quoted;
+
+		const wchar_t c{token.type == TOKEN_TYPE::DELIM ? buf[token.begin]
+														: L'\0'};
+		if (c == L'(')
+			depth++;
+		else if (c == L')' && depth)
+			depth--;
+		quoted = c == L'\'';
+	}
+	return changed;
+}
+
+bool FormReader::get(wchar_t &c)
+{
+	while (true)
+	{
+		if (chunk_pos_ == chunk_.size())
+		{
+			chunk_.resize(kCHUNK);
+			in_.read(chunk_.data(), kCHUNK);
+			chunk_.resize(in_.gcount());
+			chunk_pos_ = 0;
+			if (chunk_.empty())
+			{
+				// the input ended in the middle of a character
+				if (std::exchange(needed_, 0))
+				{
+					c = L'\uFFFD';
+					return true;
+				}
+				return false;
+			}
+		}
+
+		const auto byte{static_cast<unsigned char>(chunk_[chunk_pos_++])};
+		if (needed_)
+		{
+			if ((byte & 0xC0) != 0x80)
+			{
+				// read the byte again as the start of the next character
+				chunk_pos_--;
+				needed_ = 0;
+				c = L'\uFFFD';
+				return true;
+			}
+			partial_ = partial_ << 6 | (byte & 0x3F);
+			if (--needed_)
+				continue;
+			c = static_cast<wchar_t>(partial_);
+			return true;
+		}
+
+		if (byte < 0x80)
+		{
+			c = static_cast<wchar_t>(byte);
+			return true;
+		}
+		if ((byte & 0xE0) == 0xC0)
+		{
+			partial_ = byte & 0x1F;
+			needed_ = 1;
+		}
+		else if ((byte & 0xF0) == 0xE0)
+		{
+			partial_ = byte & 0x0F;
+			needed_ = 2;
+		}
+		else if ((byte & 0xF8) == 0xF0)
+		{
+			partial_ = byte & 0x07;
+			needed_ = 3;
+		}
+		else
+		{
+			c = L'\uFFFD';
+			return true;
+		}
+	}
+}
+
+std::optional<std::wstring_view> FormReader::next()
+{
+	form_.clear();
+	size_t depth{};
+	// whether a top level atom is being read, the form ends with it
+	bool atom{};
+
+	wchar_t c;
+	while (get(c))
+	{
+		if (c == L'\n')
+			line_++;
+		if (comment_)
+		{
+			comment_ = c != L'\n';
+			if (comment_)
+				continue;
+		}
+		if (c == L';')
+			comment_ = true;
+
+		if (comment_ || std::iswspace(c))
+		{
+			if (atom && !depth)
+				return form_;
+			// whitespace before the form is skipped, inside it one ' ' is
+			// all the parser needs
+			if (!form_.empty() && !form_.ends_with(L' '))
+				form_.push_back(L' ');
+			continue;
+		}
+
+		if (form_.empty())
+			form_line_ = line_;
+		form_.push_back(c);
+		switch (c)
+		{
+		case L'(':
+			depth++;
+			break;
+		case L')':
+			// an unmatched one ends the form, the parser reports it
+			if (!depth || !--depth)
+				return form_;
+			break;
+		case L'\'':
+			break;
+		default:
+			atom = !depth;
+			break;
+		}
+	}
+
+	if (form_.empty())
+		return {};
+	return form_;
+}
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <istream>
+#include <optional>
+#include <string>
 #include <string_view>
 #include <vector>
 
@@ -52,6 +55,90 @@ public:
 std::pair<std::vector<parse_token_t>, ParserError>
 ParsePrintTokens(std::wstring_view string);
 
-// Returns a list of tokens for evaluating
+// Returns a list of tokens for evaluating. With use_arena the lists are
+// allocated from one Arena for the whole parse instead of one by one, meant
+// for big inputs. The arena is freed once none of its lists are used anymore
 std::pair<std::vector<token_t>, ParserError>
-ParseEvalTokens(std::wstring_view string);
+ParseEvalTokens(std::wstring_view string, bool use_arena = false);
+
+// A token of a buffer that's being edited. It's where the token is in the
+// buffer rather than a view of it, so it stays valid as the buffer changes
+struct lexed_token_t
+{
+	TOKEN_TYPE type;
+	bool quoted{false};
+	// the parens open before it, an unmatched ) doesn't count
+	uint depth{};
+	uint begin{};
+	uint size{};
+};
+
+// Lexes a buffer into the tokens ParsePrintTokens would give, but keeps them
+// between edits and only lexes the part of the buffer around an edit again.
+// The tokens after it are moved along and keep their type
+class PromptLexer
+{
+public:
+	/**
+	 * @brief updates the tokens for an edit that replaced erased characters
+	 *at pos with inserted new ones
+	 * @param buf the buffer after the edit
+	 * @return the index of the first token that changed, the ones before it
+	 *are untouched
+	 **/
+	size_t edit(std::wstring_view buf, size_t pos, size_t erased,
+				size_t inserted);
+
+	const std::vector<lexed_token_t> &tokens() const
+	{
+		return tokens_;
+	}
+
+private:
+	std::vector<lexed_token_t> tokens_{};
+};
+
+// Splits UTF-8 source read from a stream into its top level forms, reading it
+// a chunk at a time so only the form being read is ever kept in memory. A form
+// can span any number of lines, whitespace between its tokens becomes a ' '
+// and ; comments are dropped
+class FormReader
+{
+public:
+	static constexpr size_t kCHUNK{1 << 16};
+
+	explicit FormReader(std::istream &in) : in_{in} {};
+
+	/**
+	 * @return the next top level form as soon as its complete, or nothing at
+	 *the end of the input. A form still open at the end is returned as it is
+	 *for ParseEvalTokens to report. The view is valid until the next call
+	 **/
+	std::optional<std::wstring_view> next();
+
+	// the line the last form started on, counted from 1
+	size_t line() const
+	{
+		return form_line_;
+	}
+
+private:
+	/**
+	 * @brief decodes the next character, malformed UTF-8 becomes U+FFFD
+	 * @return false at the end of the input
+	 **/
+	bool get(wchar_t &c);
+
+	std::istream &in_;
+	std::string chunk_{};
+	size_t chunk_pos_{};
+	// a character split across two chunks, and how many bytes it still needs
+	char32_t partial_{};
+	uint8_t needed_{};
+
+	std::wstring form_{};
+	// a form can end on the ; that starts a comment
+	bool comment_{};
+	size_t line_{1};
+	size_t form_line_{1};
+};
@@ -0,0 +1,120 @@
+#include "pool.hpp"
+
+#include <algorithm>
+
+namespace
+{
+// how many chunks every worker gets at the start of a run, more make it
+// easier to even out uneven work but cost more taking
+constexpr size_t kCHUNKS_PER_WORKER{4};
+}  // namespace
+
+WorkPool::WorkPool(size_t workers)
+{
+	workers = std::max<size_t>(workers, 1);
+	for (size_t i{0}; i < workers; i++)
+		queues_.push_back(std::make_unique<queue_t>());
+	for (size_t i{1}; i < workers; i++)
+		threads_.emplace_back(&WorkPool::loop, this, i);
+}
+
+WorkPool::~WorkPool()
+{
+	{
+		std::lock_guard lock{mutex_};
+		stopping_ = true;
+	}
+	cv_.notify_all();
+	for (auto &i : threads_)
+		i.join();
+}
+
+void WorkPool::run(size_t count, const task_fn &task)
+{
+	if (!count)
+		return;
+
+	const size_t chunks{std::min(count, size() * kCHUNKS_PER_WORKER)};
+	// set before any chunk is queued, taking a chunk locks the queue it was
+	// in which makes these visible to whoever took it
+	task_ = &task;
+	left_.store(chunks, std::memory_order_relaxed);
+	for (size_t i{0}; i < chunks; i++)
+	{
+		auto &queue{*queues_[i % size()]};
+		std::lock_guard lock{queue.mutex};
+		queue.ranges.emplace_back(count * i / chunks, count * (i + 1) / chunks);
+	}
+
+	{
+		std::lock_guard lock{mutex_};
+		generation_++;
+	}
+	cv_.notify_all();
+
+	work(0);
+
+	std::unique_lock lock{mutex_};
+	done_.wait(lock,
+			   [this]() { return !left_.load(std::memory_order_acquire); });
+}
+
+void WorkPool::work(size_t worker)
+{
+	range_t range{};
+	while (take(worker, range))
+	{
+		for (size_t i{range.first}; i < range.second; i++)
+			(*task_)(worker, i);
+		if (left_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			// under the lock so run can't miss it between checking and
+			// waiting
+			std::lock_guard lock{mutex_};
+			done_.notify_all();
+		}
+	}
+}
+
+bool WorkPool::take(size_t worker, range_t &range)
+{
+	{
+		auto &own{*queues_[worker]};
+		std::lock_guard lock{own.mutex};
+		if (!own.ranges.empty())
+		{
+			range = own.ranges.front();
+			own.ranges.pop_front();
+			return true;
+		}
+	}
+	for (size_t i{1}; i < size(); i++)
+	{
+		auto &victim{*queues_[(worker + i) % size()]};
+		std::lock_guard lock{victim.mutex};
+		if (!victim.ranges.empty())
+		{
+			range = victim.ranges.back();
+			victim.ranges.pop_back();
+			return true;
+		}
+	}
+	return false;
+}
+
+void WorkPool::loop(size_t worker)
+{
+	size_t seen{};
+	while (true)
+	{
+		{
+			std::unique_lock lock{mutex_};
+			cv_.wait(lock, [this, seen]()
+					 { return stopping_ || generation_ != seen; });
+			if (stopping_)
+				return;
+			seen = generation_;
+		}
+		work(worker);
+	}
+}
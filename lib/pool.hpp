@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// A fixed set of threads that work through the indices of one run at a time.
+// The indices are handed out in chunks, every worker has a queue of its own
+// and steals from the back of the others once its queue is empty, so workers
+// that get cheap chunks take over the rest of the expensive ones
+class WorkPool
+{
+public:
+	// called with the worker running it and the index
+	using task_fn = std::function<void(size_t, size_t)>;
+
+	/**
+	 * @brief a pool of workers workers, the thread calling run is one of
+	 *them so workers - 1 threads are started
+	 **/
+	explicit WorkPool(size_t workers);
+
+	// waits for the workers to finish what they are doing and stops them
+	~WorkPool();
+
+	WorkPool(const WorkPool &) = delete;
+	void operator=(const WorkPool &) = delete;
+
+	size_t size() const
+	{
+		return queues_.size();
+	}
+
+	/**
+	 * @brief calls task for every index below count and returns once they
+	 *are all done. The calling thread works as worker 0, the rest run on the
+	 *pool's threads. Only one thread may call run at a time
+	 **/
+	void run(size_t count, const task_fn &task);
+
+private:
+	// the indices [first, last)
+	using range_t = std::pair<size_t, size_t>;
+
+	struct queue_t
+	{
+		std::mutex mutex{};
+		std::deque<range_t> ranges{};
+	};
+
+	// runs chunks until there are none left to take or steal
+	void work(size_t worker);
+	// the next chunk of the workers own queue, or one stolen from another
+	bool take(size_t worker, range_t &range);
+	void loop(size_t worker);
+
+	std::vector<std::unique_ptr<queue_t>> queues_{};
+	std::vector<std::thread> threads_{};
+
+	const task_fn *task_{};
+	// chunks of the current run that aren't done yet
+	std::atomic<size_t> left_{};
+
+	std::mutex mutex_{};
+	// the workers wait for a new run on cv_, run waits for them on done_
+	std::condition_variable cv_{};
+	std::condition_variable done_{};
+	size_t generation_{};
+	bool stopping_{};
+};
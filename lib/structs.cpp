@@ -1,13 +1,23 @@
 #include "structs.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <compare>
+#include <deque>
 #include <format>
 #include <iostream>
+#include <mutex>
 #include <optional>
 #include <ranges>
-#include <sstream>
+#include <shared_mutex>
+#include <span>
 #include <string>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+#include "heap.hpp"
 
 inline const wchar_t *TokenTypeToString(const TOKEN_TYPE &tt)
 {
@@ -30,165 +40,508 @@ inline const wchar_t *TokenTypeToString(const TOKEN_TYPE &tt)
 	}
 }
 
-std::strong_ordering
-token_t::nested_check(const token_t &l, const token_t &r) const
+namespace
+{
+struct symbol_table_t
+{
+	std::shared_mutex mutex_{};
+	// a deque so the names never move, ids_ holds views into them
+	std::deque<std::wstring> names_{L""};
+	std::unordered_map<std::wstring_view, symbol_t> ids_{{names_.front(), 0}};
+};
+
+symbol_table_t &GetSymbolTable()
+{
+	static symbol_table_t table{};
+	return table;
+}
+}  // namespace
+
+symbol_t SymbolTable::intern(std::wstring_view name)
+{
+	auto &table{GetSymbolTable()};
+	{
+		std::shared_lock lock{table.mutex_};
+		if (auto it{table.ids_.find(name)}; it != table.ids_.end())
+			return it->second;
+	}
+
+	std::unique_lock lock{table.mutex_};
+	// someone might have interned it while we didn't hold the lock
+	if (auto it{table.ids_.find(name)}; it != table.ids_.end())
+		return it->second;
+	symbol_t id = table.names_.size();
+	table.ids_.emplace(table.names_.emplace_back(name), id);
+	return id;
+}
+
+const std::wstring &SymbolTable::name(symbol_t id)
+{
+	auto &table{GetSymbolTable()};
+	std::shared_lock lock{table.mutex_};
+	assert(id < table.names_.size());
+	return table.names_[id];
+}
+
+void *Arena::do_allocate(size_t bytes, size_t alignment)
+{
+	auto misalign{reinterpret_cast<uintptr_t>(next_) & (alignment - 1)};
+	size_t pad{misalign ? alignment - misalign : 0};
+	if (pad + bytes > left_)
+	{
+		// blocks double up to a limit, something bigger gets its own block
+		size_t size{std::max(block_size_, bytes + alignment)};
+		block_size_ = std::min(block_size_ * 2, kMAX_BLOCK);
+		next_ = blocks_.emplace_back(new std::byte[size]).get();
+		left_ = size;
+		misalign = reinterpret_cast<uintptr_t>(next_) & (alignment - 1);
+		pad = misalign ? alignment - misalign : 0;
+	}
+	void *ret{next_ + pad};
+	next_ += pad + bytes;
+	left_ -= pad + bytes;
+	return ret;
+}
+
+object_t *Arena::make_object()
+{
+	retain();
+	return new (allocate(sizeof(object_t), alignof(object_t)))
+		object_t{.refs{1},
+				 .front{0},
+				 .arena = this,
+				 .apval = elements_t{this}};
+}
+
+void object_ptr_t::release(object_t *object)
+{
+	// freeing a list frees the lists inside it, this is done off a work list
+	// so a deeply nested list can't overflow the stack. The list is kept
+	// between calls so it only allocates while it grows, a nested release
+	// can share it since whoever pops an object frees it
+	thread_local std::vector<object_t *> dead{};
+	while (object)
+	{
+		// the first dead child is freed next without going through the work
+		// list, so freeing a list that holds a single list doesn't allocate
+		object_t *next{};
+		for (token_t &i : object->apval)
+		{
+			object_t *child{std::exchange(i.object.ptr_, nullptr)};
+			if (!child ||
+				child->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+				continue;
+			if (next)
+				dead.push_back(child);
+			else
+				next = child;
+		}
+		if (Arena *arena{object->arena})
+		{
+			// the memory goes with the arena
+			object->~object_t();
+			arena->release();
+		}
+		else
+			delete object;
+
+		object = next;
+		if (!object && !dead.empty())
+		{
+			object = dead.back();
+			dead.pop_back();
+		}
+	}
+}
+
+elements_t &token_t::apval_mut()
+{
+	if (!object)
+		object = object_ptr_t{new object_t{}};
+	else if (!object.unique() ||
+			 (type == TOKEN_TYPE::LIST &&
+			  (first || object->front.load(std::memory_order_relaxed))))
+	{
+		// only a list that owns all of its object can be written in place
+		auto elements{apval()};
+		object = object_ptr_t{
+			new object_t{.refs{1},
+						 .front{0},
+						 .apval{elements.begin(), elements.end()},
+						 .expr{object->expr},
+						 .env{object->env},
+						 .code{object->code}}};
+		if (type == TOKEN_TYPE::LIST)
+			first = 0;
+	}
+	return object->apval;
+}
+
+token_t token_t::cdr() const
+{
+	token_t ret{*this};
+	if (!ret.apval().empty())
+		ret.first++;
+	return ret;
+}
+
+token_t token_t::make_bool(bool is_true)
+{
+	static const symbol_t kT{SymbolTable::intern(L"T")};
+	static const symbol_t kNIL{SymbolTable::intern(L"NIL")};
+	return token_t{.pname = is_true ? kT : kNIL,
+				   .is_true = is_true,
+				   .type = TOKEN_TYPE::BOOL};
+}
+
+token_t token_t::make_int(BigInt val)
+{
+	if (auto fixnum{val.to_int()})
+		return token_t{.val = *fixnum, .type = TOKEN_TYPE::INT};
+	return token_t{.val = 0,
+				   .type = TOKEN_TYPE::INT,
+				   .object = object_ptr_t{new object_t{
+					   .refs{1},
+					   .big = std::make_unique<const BigInt>(std::move(val))}}};
+}
+
+token_t token_t::make_list(elements_t apval)
+{
+	return token_t{.val = 0,
+				   .type = TOKEN_TYPE::LIST,
+				   .object = object_ptr_t{
+					   new object_t{.refs{1}, .apval{std::move(apval)}}}};
+}
+
+token_t token_t::make_list(Arena &arena)
+{
+	return token_t{.val = 0,
+				   .type = TOKEN_TYPE::LIST,
+				   .object = object_ptr_t{arena.make_object()}};
+}
+
+token_t token_t::make_cons(token_t car, const token_t &cdr)
+{
+	// the slot right in front of cdr is free for the first cons onto it,
+	// claiming it makes the list without copying cdr. Any other cons onto
+	// the same cdr finds it taken
+	if (cdr.object && cdr.first)
+	{
+		uint32_t expected{cdr.first};
+		if (cdr.object->front.compare_exchange_strong(
+				expected, cdr.first - 1, std::memory_order_acq_rel))
+		{
+			token_t ret{cdr};
+			ret.first--;
+			// cdr now holds car, if car holds cdr thats a cycle
+			if (car.object)
+				Heap::track(ret.object);
+			ret.object->apval[ret.first] = std::move(car);
+			return ret;
+		}
+	}
+
+	// copy cdr behind as much free room as it is long, so the conses that
+	// follow are constant time again
+	auto tail{cdr.apval()};
+	const size_t room{std::max<size_t>(tail.size(), 4)};
+	elements_t elements{};
+	elements.reserve(room + 1 + tail.size());
+	elements.resize(room);
+	elements.push_back(std::move(car));
+	elements.insert(elements.end(), tail.begin(), tail.end());
+
+	token_t ret{make_list(std::move(elements))};
+	ret.first = room;
+	ret.object->front.store(room, std::memory_order_relaxed);
+	ret.quoted = cdr.quoted;
+	return ret;
+}
+
+token_t token_t::make_lambda(std::span<const token_t> params,
+							 std::shared_ptr<token_t> expr,
+							 std::shared_ptr<env_t> env,
+							 std::shared_ptr<const chunk_t> code,
+							 symbol_t name)
+{
+	return token_t{.pname = name,
+				   .type = TOKEN_TYPE::LAMBDA,
+				   .object = object_ptr_t{
+					   new object_t{.refs{1},
+									.apval{params.begin(), params.end()},
+									.expr{std::move(expr)},
+									.env{std::move(env)},
+									.code{std::move(code)}}}};
+}
+
+namespace
+{
+// The order of two atoms of the same type
+std::strong_ordering CompareAtoms(const token_t &l, const token_t &r)
 {
-	if (l.type != r.type)
-		return std::strong_ordering::less;
 	switch (l.type)
 	{
 	case TOKEN_TYPE::SYMBOL:
 	case TOKEN_TYPE::DELIM:
 		return l.pname <=> r.pname;
-	case TOKEN_TYPE::LIST:
-		if (!l.apval.empty() || !r.apval.empty())
-		{
-			if (l.apval.size() != r.apval.size())
-				return l.apval.size() <=> r.apval.size();
-			for (size_t i{0}; i < l.apval.size(); i++)
-				if (nested_check(l.apval[i], r.apval[i]) != 0)
-					return nested_check(l.apval[i], r.apval[i]);
-		}
-		return l.apval.size() <=> r.apval.size();
 	case TOKEN_TYPE::INT:
-		return l.val <=> r.val;
+		// a big int never fits in val, so two of them only compare by value
+		// when either one is big
+		if (!l.big() && !r.big())
+			return l.val <=> r.val;
+		return (l.big() ? *l.big() : BigInt{l.val}) <=>
+			   (r.big() ? *r.big() : BigInt{r.val});
 	case TOKEN_TYPE::BOOL:
 		return l.is_true <=> r.is_true;
+	case TOKEN_TYPE::LIST:
 	case TOKEN_TYPE::LAMBDA:
-		if (*l.expr == *r.expr)
+		break;
+	}
+	return std::strong_ordering::equal;
+}
+}  // namespace
+
+std::strong_ordering
+token_t::nested_check(const token_t &l, const token_t &r) const
+{
+	// comparing atoms, or lists against the empty list, is the common case.
+	// It needs none of the pairs below, which would allocate
+	if (l.type == r.type && l.type != TOKEN_TYPE::LIST &&
+		l.type != TOKEN_TYPE::LAMBDA)
+		return CompareAtoms(l, r);
+	if (l.type == TOKEN_TYPE::LIST && r.type == TOKEN_TYPE::LIST &&
+		(l.apval().size() != r.apval().size() || l.apval().empty()))
+		return l.apval().size() <=> r.apval().size();
+
+	// the pairs still to compare, in order, kept on the heap so deeply nested
+	// tokens can't overflow the stack. args_only compares the argument lists
+	// of two lambdas whose bodies were already equal
+	struct pair_t
+	{
+		const token_t *l;
+		const token_t *r;
+		bool args_only{false};
+	};
+	std::vector<pair_t> pairs{{.l = &l, .r = &r}};
+
+	// queues the elements of two equally long lists, first one on top
+	auto push_elements =
+		[&pairs](std::span<const token_t> l, std::span<const token_t> r)
+	{
+		for (size_t i{l.size()}; i > 0; i--)
+			pairs.push_back({.l = &l[i - 1], .r = &r[i - 1]});
+	};
+
+	while (!pairs.empty())
+	{
+		auto [l, r, args_only]{pairs.back()};
+		pairs.pop_back();
+
+		if (!args_only && l->type != r->type)
+			return std::strong_ordering::less;
+		if (args_only || l->type == TOKEN_TYPE::LIST)
 		{
-			if (!l.apval.empty() || !r.apval.empty())
-			{
-				if (l.apval.size() != r.apval.size())
-					return l.apval.size() <=> r.apval.size();
-				for (size_t i{0}; i < l.apval.size(); i++)
-					if (nested_check(l.apval[i], r.apval[i]) != 0)
-						return nested_check(l.apval[i], r.apval[i]);
-			}
-			return l.apval.size() <=> r.apval.size();
+			if (l->apval().size() != r->apval().size())
+				return l->apval().size() <=> r->apval().size();
+			push_elements(l->apval(), r->apval());
+			continue;
 		}
-		return (*l.expr <=> *r.expr);
+
+		if (l->type == TOKEN_TYPE::LAMBDA)
+		{
+			// the bodies first, then the arguments
+			pairs.push_back({.l = l, .r = r, .args_only = true});
+			pairs.push_back({.l = l->expr().get(), .r = r->expr().get()});
+		}
+		else if (auto order{CompareAtoms(*l, *r)}; order != 0)
+			return order;
 	}
-	return std::strong_ordering::less;
+	return std::strong_ordering::equal;
 }
 
 // This is so we have a string to print to the output, as opposed to the
 // ostream<< which is meant for debugging
 token_t::operator std::wstring() const
 {
-	std::wstringstream ss;
-	ss << (quoted ? L"'" : L"");
-	switch (type)
+	std::wstring ret{};
+	for (TokenSpans spans{*this}; auto span{spans.next()};)
+		ret += span->text;
+	return ret;
+};
+
+std::optional<TokenSpans::span_t> TokenSpans::next()
+{
+	// queues the elements of a list seperated by spaces, first one on top
+	auto push_elements = [this](std::span<const token_t> list)
 	{
-	case TOKEN_TYPE::DELIM:
-		break;
-	case TOKEN_TYPE::LIST:
+		for (size_t i{list.size()}; i > 0; i--)
+		{
+			out_.push_back(&list[i - 1]);
+			if (i > 1)
+				out_.push_back(L" ");
+		}
+	};
+
+	while (!out_.empty())
 	{
-		ss << L"(";
-		for (auto &i : apval)
+		auto item{out_.back()};
+		if (auto text{std::get_if<const wchar_t *>(&item)})
 		{
-			ss << static_cast<std::wstring>(i);
-			if (&i != &apval.back())
-				ss << L" ";
+			out_.pop_back();
+			return span_t{.type = TOKEN_TYPE::DELIM, .text = *text};
 		}
-		ss << L")";
-	}
-	break;
-	case TOKEN_TYPE::SYMBOL:
-		ss << *pname;
-		break;
-	case TOKEN_TYPE::INT:
-		ss << val;
-		break;
-	case TOKEN_TYPE::BOOL:
-		ss << (is_true ? L"T" : L"NIL");
-		break;
-	case TOKEN_TYPE::LAMBDA:
-		ss << L"(";
-		for (auto &i : apval)
+
+		const token_t &t{*std::get<const token_t *>(item)};
+		if (t.quoted && unquoted_ != &t)
 		{
-			ss << static_cast<std::wstring>(i);
-			if (&i != &apval.back())
-				ss << L" ";
+			unquoted_ = &t;
+			return span_t{.type = TOKEN_TYPE::DELIM, .text = L"'"};
+		}
+		unquoted_ = nullptr;
+		out_.pop_back();
+
+		switch (t.type)
+		{
+		case TOKEN_TYPE::DELIM:
+			break;
+		case TOKEN_TYPE::LIST:
+			out_.push_back(L")");
+			push_elements(t.apval());
+			return span_t{.type = TOKEN_TYPE::DELIM, .text = L"("};
+		case TOKEN_TYPE::SYMBOL:
+			return span_t{.type = TOKEN_TYPE::SYMBOL,
+						  .text = SymbolTable::name(t.pname)};
+		case TOKEN_TYPE::INT:
+		{
+			if (const BigInt *big{t.big()})
+			{
+				big_digits_ = big->to_string();
+				return span_t{.type = TOKEN_TYPE::INT, .text = big_digits_};
+			}
+			// to_chars only writes chars, digits are the same in both
+			char digits[kDIGITS];
+			const auto end{std::to_chars(std::begin(digits),
+										 std::end(digits), t.val)
+							   .ptr};
+			std::copy(std::begin(digits), end, std::begin(digits_));
+			return span_t{.type = TOKEN_TYPE::INT,
+						  .text = {digits_, static_cast<size_t>(
+												end - std::begin(digits))}};
+		}
+		case TOKEN_TYPE::BOOL:
+			return span_t{.type = TOKEN_TYPE::BOOL,
+						  .text = t.is_true ? L"T" : L"NIL"};
+		case TOKEN_TYPE::LAMBDA:
+		{
+			// a folded body prints the way it was written
+			const token_t *body{t.expr().get()};
+			if (body->type == TOKEN_TYPE::LIST && body->apval().size() == 3 &&
+				body->apval().front().type == TOKEN_TYPE::SYMBOL &&
+				body->apval().front().pname == kFOLDED)
+				body = &body->apval()[2];
+			out_.push_back(body);
+			out_.push_back(L" ");
+			out_.push_back(L")");
+			push_elements(t.apval());
+			return span_t{.type = TOKEN_TYPE::DELIM, .text = L"("};
+		}
 		}
-		ss << L")";
-		ss << L" ";
-		ss << static_cast<std::wstring>(*expr);
-		break;
 	}
-	return ss.str();
-};
+	return {};
+}
 
 std::wostream &token_t::recursive_out(
 	std::wostream &os, const token_t &t, const std::wstring &pre)
 {
-	assert(t != token_t{});
-	os << std::format(
-		L"{}type: {:>6.6s}, quoted: {:5}, pname: {} ", pre,
-		TokenTypeToString(t.type), t.quoted, (t.pname ? *t.pname : L""));
-	switch (t.type)
+	// what's left to print, a token with its indent, the env of a lambda or
+	// plain text. Kept on the heap so deeply nested tokens can't overflow the
+	// stack
+	struct item_t
 	{
-	case TOKEN_TYPE::DELIM:
-		return os;
-	case TOKEN_TYPE::BOOL:
-		return os << std::format(L"bool: {}", t.is_true);
-	case TOKEN_TYPE::INT:
-		return os << std::format(L"val: {}", t.val);
-	case TOKEN_TYPE::SYMBOL:
-		os << std::format(L"\n{}apval:", pre);
-		os << std::format(L"\n{}[", pre);
-		for (auto &i : t.apval)
+		const token_t *token{};
+		std::shared_ptr<env_t> env{};
+		std::wstring text{};
+	};
+	std::vector<item_t> out{{.token = &t, .text = pre}};
+
+	while (!out.empty())
+	{
+		item_t item{std::move(out.back())};
+		out.pop_back();
+		if (item.env)
 		{
-			os << "\n";
-			recursive_out(os, i, pre + L"\t");
+			env_t::formated_out(os, item.env, item.text);
+			continue;
 		}
-		os << std::format(L"\n{}]", pre);
-		return os;
-	case TOKEN_TYPE::LIST:
-		os << std::format(L"\n{}apval:", pre);
-		os << std::format(L"\n{}[", pre);
-		for (auto &i : t.apval)
+		if (!item.token)
 		{
-			os << "\n";
-			recursive_out(os, i, pre + L"\t");
+			os << item.text;
+			continue;
 		}
-		os << std::format(L"\n{}]", pre);
-		return os;
-	case TOKEN_TYPE::LAMBDA:
-		os << std::format(L"\n{}apval:", pre);
-		os << std::format(L"\n{}[", pre);
-		for (auto &i : t.apval)
+
+		const token_t &token{*item.token};
+		const std::wstring &indent{item.text};
+		assert(token != token_t{});
+		// ints and lists keep their value or offset where the name would be
+		os << std::format(L"{}type: {:>6.6s}, quoted: {:5}, pname: {} ",
+						  indent, TokenTypeToString(token.type),
+						  bool{token.quoted},
+						  SymbolTable::name(token.type == TOKEN_TYPE::INT ||
+												token.type == TOKEN_TYPE::LIST
+											? symbol_t{}
+											: token.pname));
+		switch (token.type)
 		{
-			os << "\n";
-			recursive_out(os, i, pre + L"\t");
-		}
-		os << std::format(L"\n{}]", pre);
-		os << std::format(L"\n{}expr:", pre);
-		os << std::format(L"\n{}[\n", pre);
-		recursive_out(os, *t.expr, pre + L"\t");
-		os << std::format(L"\n{}]", pre);
-
-		os << std::format(L"\n{}env:", pre);
-		os << std::format(L"\n{}[\n", pre);
-		env_t::formated_out(os, t.env, pre + L"\t");
-		os << std::format(L"\n{}]\n", pre);
-		return os;
-	default:
-		return os;
+		case TOKEN_TYPE::DELIM:
+			continue;
+		case TOKEN_TYPE::BOOL:
+			os << std::format(L"bool: {}", bool{token.is_true});
+			continue;
+		case TOKEN_TYPE::INT:
+			if (const BigInt *big{token.big()})
+				os << std::format(L"val: {}", big->to_string());
+			else
+				os << std::format(L"val: {}", token.val);
+			continue;
+		case TOKEN_TYPE::SYMBOL:
+		case TOKEN_TYPE::LIST:
+			out.push_back({.text = std::format(L"\n{}]", indent)});
+			break;
+		case TOKEN_TYPE::LAMBDA:
+			// pushed backwards, the apval is printed first
+			out.push_back({.text = std::format(L"\n{}]\n", indent)});
+			out.push_back({.env = token.env(), .text = indent + L"\t"});
+			out.push_back({.text = std::format(L"\n{}]\n{}env:\n{}[\n",
+											   indent, indent, indent)});
+			out.push_back(
+				{.token = token.expr().get(), .text = indent + L"\t"});
+			out.push_back({.text = std::format(L"\n{}]\n{}expr:\n{}[\n",
+											   indent, indent, indent)});
+			break;
+		}
+
+		os << std::format(L"\n{}apval:\n{}[", indent, indent);
+		for (size_t i{token.apval().size()}; i > 0; i--)
+		{
+			out.push_back(
+				{.token = &token.apval()[i - 1], .text = indent + L"\t"});
+			out.push_back({.text = L"\n"});
+		}
 	}
+	return os;
 }
 
-std::optional<token_t> env_t::find(const token_t &token)
+token_t *env_t::find(const token_t &token)
 {
-	assert(!token.pname->empty());
-	if (!curr_env_.contains(*token.pname))
+	assert(token.pname);
+	for (env_t *env{this}; env; env = env->next_env_.get())
 	{
-		if (next_env_)
-			return next_env_->find(token);
-		else
-			return {};
+		if (auto slot{env->slot_of(token.pname)})
+			return &env->slots_[*slot];
+		if (auto value{env->curr_env_.find(token.pname)})
+			return value;
 	}
-	return curr_env_[*token.pname];
+	return nullptr;
 }
 
 void env_t::formated_out(
@@ -207,12 +560,21 @@ void env_t::formated_out(
 
 	os << std::format(L"{}name: {}\n", pre, t->env_name_);
 	os << std::format(L"{}-----------\n", pre);
-	for (auto &i : t->curr_env_)
+	for (size_t i{0}; i < t->slots_.size(); i++)
 	{
-		os << std::format(L"{}name: {}\n", pre, i.first);
-		token_t::recursive_out(os, i.second, pre + L"\t");
+		os << std::format(
+			L"{}name: {}\n", pre, SymbolTable::name(t->names_[i]));
+		token_t::recursive_out(os, t->slots_[i], pre + L"\t");
 		os << "\n";
 	}
+	t->curr_env_.for_each(
+		[&os, &pre](symbol_t name, const token_t &value)
+		{
+			os << std::format(
+				L"{}name: {}\n", pre, SymbolTable::name(name));
+			token_t::recursive_out(os, value, pre + L"\t");
+			os << "\n";
+		});
 	os << std::format(L"{}-----------\n", pre);
 }
 
@@ -230,12 +592,19 @@ std::wostream &operator<<(std::wostream &os, const env_t &t)
 	os << "-----------\n";
 
 	os << "name: " << t.env_name_ << "\n";
-	for (auto &i : t.curr_env_)
+	for (size_t i{0}; i < t.slots_.size(); i++)
 	{
-		os << "name: " << i.first << "\n";
-		token_t::recursive_out(os, i.second, L"\t");
+		os << "name: " << SymbolTable::name(t.names_[i]) << "\n";
+		token_t::recursive_out(os, t.slots_[i], L"\t");
 		os << "\n";
 	}
+	t.curr_env_.for_each(
+		[&os](symbol_t name, const token_t &value)
+		{
+			os << "name: " << SymbolTable::name(name) << "\n";
+			token_t::recursive_out(os, value, L"\t");
+			os << "\n";
+		});
 	os << "-----------\n";
 	return os;
 }
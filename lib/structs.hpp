@@ -1,12 +1,20 @@
 #pragma once
 
+#include <atomic>
 #include <compare>
+#include <cstdint>
 #include <memory>
+#include <memory_resource>
 #include <optional>
+#include <span>
+#include <string>
 #include <string_view>
-#include <unordered_map>
+#include <utility>
+#include <variant>
 #include <vector>
 
+#include "bigint.hpp"
+
 enum class TOKEN_TYPE : uint8_t
 {
 	DELIM,
@@ -19,7 +27,142 @@ enum class TOKEN_TYPE : uint8_t
 
 const wchar_t *TokenTypeToString(const TOKEN_TYPE &tt);
 
+// An interned name, 0 is always the empty name
+using symbol_t = uint32_t;
+
+// Every name the parser sees is interned here once, tokens and environments
+// only carry the id. Symbols are never freed so ids and names stay valid for
+// the life of the program. Safe to use from multiple threads
+class SymbolTable
+{
+public:
+	static symbol_t intern(std::wstring_view name);
+
+	static const std::wstring &name(symbol_t id);
+};
+
+// The head of a lambda body that constant folding changed, (folded written).
+// The parser never makes a symbol with a space in it, so it is never bound
+inline const symbol_t kFOLDED{SymbolTable::intern(L" folded")};
+
+// A flat open addressed hash map keyed by interned symbols, a lookup is an
+// integer probe into one array instead of hashing a string
+template <typename T>
+class symbol_map
+{
+private:
+	struct slot_t
+	{
+		// 0 is the empty name which is never bound, so it marks a free slot
+		symbol_t key{};
+		T value{};
+	};
+
+	std::vector<slot_t> slots_{};
+	size_t size_{};
+
+	// fibonacci hashing, ids are handed out sequentially so this spreads
+	// them over the table
+	size_t probe_start(symbol_t key) const
+	{
+		return (key * 0x9E3779B9u) & (slots_.size() - 1);
+	}
+
+	slot_t *lookup(symbol_t key)
+	{
+		if (slots_.empty())
+			return nullptr;
+		for (size_t i{probe_start(key)};; i = (i + 1) & (slots_.size() - 1))
+		{
+			if (slots_[i].key == key)
+				return &slots_[i];
+			if (!slots_[i].key)
+				return nullptr;
+		}
+	}
+
+	void grow()
+	{
+		std::vector<slot_t> old{std::move(slots_)};
+		slots_ = std::vector<slot_t>(old.empty() ? 8 : old.size() * 2);
+		size_ = 0;
+		for (auto &i : old)
+			if (i.key)
+				insert(i.key, std::move(i.value), false);
+	}
+
+	std::pair<T *, bool> insert(symbol_t key, T &&value, bool assign)
+	{
+		// keep the load factor under 3/4 so probes stay short
+		if ((size_ + 1) * 4 > slots_.size() * 3)
+			grow();
+		for (size_t i{probe_start(key)};; i = (i + 1) & (slots_.size() - 1))
+		{
+			if (!slots_[i].key)
+			{
+				slots_[i] = slot_t{key, std::move(value)};
+				size_++;
+				return {&slots_[i].value, true};
+			}
+			if (slots_[i].key == key)
+			{
+				if (assign)
+					slots_[i].value = std::move(value);
+				return {&slots_[i].value, false};
+			}
+		}
+	}
+
+public:
+	T *find(symbol_t key)
+	{
+		auto slot{lookup(key)};
+		return slot ? &slot->value : nullptr;
+	}
+
+	bool contains(symbol_t key) const
+	{
+		return const_cast<symbol_map *>(this)->lookup(key);
+	}
+
+	// inserts the value unless the key is already bound
+	std::pair<T *, bool> emplace(symbol_t key, T value)
+	{
+		return insert(key, std::move(value), false);
+	}
+
+	void insert_or_assign(symbol_t key, T value)
+	{
+		insert(key, std::move(value), true);
+	}
+
+	size_t size() const
+	{
+		return size_;
+	}
+
+	template <typename F>
+	void for_each(F &&f) const
+	{
+		for (auto &i : slots_)
+			if (i.key)
+				f(i.key, i.value);
+	}
+};
+
 struct env_t;
+struct chunk_t;
+
+// Where a symbol is looked up when it gets evaluated
+enum class SCOPE : uint8_t
+{
+	// by name through the whole environment chain
+	DYNAMIC,
+	// a slot of one of the enclosing lambda frames, see token_t::depth
+	LEXICAL,
+	// straight in the global environment
+	GLOBAL,
+};
 
 // we template out the token type into
 // parse tokens
@@ -31,24 +174,168 @@ struct parse_token_t
 	std::wstring_view pname;
 };
 
+struct object_t;
+class token_t;
+
+// The elements of a list, they come from an Arena when the list was parsed
+// into one and from the heap otherwise
+using elements_t = std::pmr::vector<token_t>;
+
+// A bump allocator for the lists of one parse. Nothing is freed on its own,
+// the whole arena goes at once when the parse and every object made in it
+// have released it
+class Arena : public std::pmr::memory_resource
+{
+private:
+	std::vector<std::unique_ptr<std::byte[]>> blocks_{};
+	std::byte *next_{};
+	size_t left_{};
+	size_t block_size_{kFIRST_BLOCK};
+	// the parse holds one reference, every object made in the arena another
+	std::atomic<size_t> refs_{1};
+
+	static constexpr size_t kFIRST_BLOCK{4096};
+	static constexpr size_t kMAX_BLOCK{1 << 20};
+
+	void *do_allocate(size_t bytes, size_t alignment) override;
+	void do_deallocate(void *, size_t, size_t) override {}
+	bool do_is_equal(const memory_resource &other) const noexcept override
+	{
+		return this == &other;
+	}
+
+public:
+	// an empty object for a list, made in the arena
+	object_t *make_object();
+
+	void retain()
+	{
+		refs_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// deletes the arena once nothing uses it anymore, arenas have to be made
+	// with new
+	void release()
+	{
+		if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			delete this;
+	}
+
+	// how many blocks the arena took from the heap so far
+	size_t blocks() const
+	{
+		return blocks_.size();
+	}
+};
+
+// An owning pointer to the heap object of a list or a lambda, the count lives
+// in the object itself so the pointer is a single word
+class object_ptr_t
+{
+private:
+	object_t *ptr_{};
+
+	static void release(object_t *object);
+
+public:
+	object_ptr_t() = default;
+	explicit object_ptr_t(object_t *ptr) : ptr_{ptr} {}
+	object_ptr_t(const object_ptr_t &other);
+	object_ptr_t(object_ptr_t &&other) noexcept
+		: ptr_{std::exchange(other.ptr_, nullptr)}
+	{
+	}
+	object_ptr_t &operator=(object_ptr_t other) noexcept
+	{
+		std::swap(ptr_, other.ptr_);
+		return *this;
+	}
+	~object_ptr_t();
+
+	object_t *get() const
+	{
+		return ptr_;
+	}
+	object_t *operator->() const
+	{
+		return ptr_;
+	}
+	explicit operator bool() const
+	{
+		return ptr_;
+	}
+
+	// whether this is the only reference, so the object can be written to
+	bool unique() const;
+};
+
+// A value, 24 bytes. Ints, booleans and symbols live in the token itself,
+// lists, lambdas and ints too big for val point to a shared heap object which
+// copying only adds a reference to. Lists are immutable, a list is the tail
+// of its objects elements starting at first, so cdr and cons share the
+// elements instead of copying them
 class token_t
 {
 public:
-	int val{};
-	bool quoted{false};
-	bool is_true{false};
-	TOKEN_TYPE type;
-	/* std::shared_ptr<std::wstring> pname{std::make_shared<std::wstring>(L"")};
-	 */
-	std::shared_ptr<std::wstring> pname{};
-
-	// stores a list if its a list, if its a lambda or a function, this stores
-	// the args
-	std::vector<token_t> apval{};
-	// This is a pointer as we have to pass a single token to be evaluated, this
-	// has to be a list
-	std::shared_ptr<token_t> expr{};
-	std::shared_ptr<env_t> env{};
+	union
+	{
+		int64_t val{};
+		// the interned name of a symbol or a boolean, or of a function made by
+		// defun
+		symbol_t pname;
+		// where a list starts in its objects elements
+		uint32_t first;
+	};
+	bool quoted : 1 {false};
+	bool is_true : 1 {false};
+	// symbols inside a lambda body are resolved when the lambda is created, a
+	// LEXICAL symbol lives in slots_[slot] of the frame depth frames up
+	uint8_t slot : 6 {};
+	TOKEN_TYPE type{};
+	SCOPE scope{SCOPE::DYNAMIC};
+	uint8_t depth{};
+
+	// the furthest a LEXICAL symbol can be addressed, anything further is
+	// looked up by name
+	static constexpr size_t kMAX_SLOT{63};
+	static constexpr size_t kMAX_DEPTH{255};
+
+	// the elements of a list, or the arguments, body and environment of a
+	// lambda, or the value of a big int. Shared between copies, see apval_mut
+	object_ptr_t object{};
+
+	// the elements of a list, or the arguments of a lambda
+	std::span<const token_t> apval() const;
+	// the same, but unshared from any copies first so it can be written to
+	elements_t &apval_mut();
+
+	// the list without its first element, shares the elements with this one
+	token_t cdr() const;
+
+	// The body of a lambda, its a pointer so it can be evaluated without
+	// copying it
+	const std::shared_ptr<token_t> &expr() const;
+	const std::shared_ptr<env_t> &env() const;
+	// The compiled body of a lambda, only set when the bytecode engine created
+	// it
+	const std::shared_ptr<const chunk_t> &code() const;
+	// the value of an INT that doesn't fit in val, null if it does
+	const BigInt *big() const;
+
+	static token_t make_bool(bool is_true);
+	// an INT, big only if val doesn't fit in an int64_t
+	static token_t make_int(BigInt val);
+	static token_t make_list(elements_t apval);
+	// an empty list whose object and elements are allocated from arena
+	static token_t make_list(Arena &arena);
+	// the list car followed by the elements of cdr, constant time when
+	// nothing was consed onto cdr before
+	static token_t make_cons(token_t car, const token_t &cdr);
+	static token_t make_lambda(std::span<const token_t> params,
+							   std::shared_ptr<token_t> expr,
+							   std::shared_ptr<env_t> env,
+							   std::shared_ptr<const chunk_t> code = {},
+							   symbol_t name = {});
 
 	operator std::wstring() const;
 
@@ -76,13 +363,131 @@ public:
 	recursive_out(std::wostream &os, const token_t &t, const std::wstring &pre);
 };
 
+static_assert(sizeof(token_t) == 24);
+
+// Walks a token the way it's printed, one span of text at a time, so it can
+// be written or highlighted without building the whole string first. Parens,
+// spaces and quotes are DELIM spans, atoms have their own type
+class TokenSpans
+{
+public:
+	struct span_t
+	{
+		TOKEN_TYPE type;
+		// valid until the next call to next
+		std::wstring_view text;
+	};
+
+	explicit TokenSpans(const token_t &token) : out_{&token} {};
+
+	std::optional<span_t> next();
+
+private:
+	// what's left to print, either a token or some text. Kept on the heap so
+	// deeply nested tokens can't overflow the stack
+	std::vector<std::variant<const token_t *, const wchar_t *>> out_;
+	// the token on top of out_ whose quote was already printed
+	const token_t *unquoted_{};
+	// the text of the last INT, room for a sign and the digits of an int64_t
+	static constexpr size_t kDIGITS{21};
+	wchar_t digits_[kDIGITS]{};
+	std::wstring big_digits_{};
+};
+
+struct object_t
+{
+	std::atomic<uint32_t> refs{1};
+	// the lowest element of apval a list uses, the ones below it are free
+	// room for make_cons to put a new first element in
+	std::atomic<uint32_t> front{0};
+	// the arena the object was made in, if any
+	Arena *arena{};
+	elements_t apval{};
+	std::shared_ptr<token_t> expr{};
+	std::shared_ptr<env_t> env{};
+	std::shared_ptr<const chunk_t> code{};
+	std::unique_ptr<const BigInt> big{};
+};
+
+inline object_ptr_t::object_ptr_t(const object_ptr_t &other) : ptr_{other.ptr_}
+{
+	if (ptr_)
+		ptr_->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline object_ptr_t::~object_ptr_t()
+{
+	if (ptr_ && ptr_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		release(ptr_);
+}
+
+inline bool object_ptr_t::unique() const
+{
+	return ptr_->refs.load(std::memory_order_acquire) == 1;
+}
+
+inline std::span<const token_t> token_t::apval() const
+{
+	if (!object)
+		return {};
+	const size_t start{type == TOKEN_TYPE::LIST ? first : 0};
+	return std::span{object->apval}.subspan(start);
+}
+
+inline const std::shared_ptr<token_t> &token_t::expr() const
+{
+	return object->expr;
+}
+
+inline const std::shared_ptr<env_t> &token_t::env() const
+{
+	return object->env;
+}
+
+inline const std::shared_ptr<const chunk_t> &token_t::code() const
+{
+	return object->code;
+}
+
+inline const BigInt *token_t::big() const
+{
+	return type == TOKEN_TYPE::INT && object ? object->big.get() : nullptr;
+}
+
 struct env_t
 {
 	std::wstring env_name_{};
-	std::unordered_map<std::wstring, token_t> curr_env_{};
+	// named bindings, used by the global environment
+	symbol_map<token_t> curr_env_{};
+	// a lambdas frame keeps its arguments in a plain array, in the order they
+	// were declared in
+	std::vector<symbol_t> names_{};
+	std::vector<token_t> slots_{};
 	std::shared_ptr<env_t> next_env_{};
 
-	std::optional<token_t> find(const token_t &token);
+	// the binding of token in this frame or the first one up the chain that
+	// has it, nullptr if none does. It points into the frame, so it only
+	// stays good until the next binding is made
+	token_t *find(const token_t &token);
+
+	// the frame depth environments up the chain
+	env_t *up(uint8_t depth)
+	{
+		env_t *env{this};
+		for (; depth; depth--)
+			env = env->next_env_.get();
+		return env;
+	}
+
+	// the slot of the last argument called name, the last one wins just like
+	// it would when binding the arguments in order
+	std::optional<uint16_t> slot_of(symbol_t name) const
+	{
+		for (size_t i{names_.size()}; i > 0; i--)
+			if (names_[i - 1] == name)
+				return i - 1;
+		return {};
+	}
 
 	friend std::wostream &operator<<(std::wostream &os, const env_t &t);
 
@@ -0,0 +1,369 @@
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "bytecode.hpp"
+#include "interpreter.hpp"
+#include "structs.hpp"
+
+token_t Interpreter::execute(const chunk_t& chunk, std::shared_ptr<env_t> env)
+{
+	// A call into a compiled lambda, the caller is resumed at ip once the
+	// callee returns
+	struct frame_t
+	{
+		const chunk_t* chunk;
+		size_t ip;
+		std::shared_ptr<env_t> env;
+		// where the result goes once the call returns, if its memoized, how
+		// many errors there were before it and the callers peak_
+		MemoTable* memo{};
+		size_t errors{};
+		size_t peak{};
+	};
+
+	std::vector<token_t> stack{};
+	std::vector<frame_t> frames{{.chunk = &chunk, .ip = 0, .env = env}};
+	// the frames of the calls whose arguments are being bound, innermost
+	// last. Kept apart from the callee so the lambda itself is never
+	// copied to give it a frame
+	std::vector<std::shared_ptr<env_t>> pending{};
+
+	auto raise = [this](const EvalError& err, const std::shared_ptr<env_t>& e)
+	{
+		err_.push_back(err);
+		// the tree walker always reports where an undefined symbol was looked
+		// for
+		if (err.err_ == EvalError::Exception::UNDEFINED)
+			err_.back().env_ = e;
+	};
+
+	// The value of the symbol constants[a], a global is only looked for in the
+	// table when the globals changed since the last time. Workers leave the
+	// chunks they share alone
+	auto load = [this](const frame_t& frame, uint32_t a) -> token_t*
+	{
+		const token_t& symbol{frame.chunk->constants[a]};
+		if (symbol.scope != SCOPE::GLOBAL || parent_)
+			return lookup(symbol, *frame.env);
+
+		global_cache_t& cache{frame.chunk->globals[a]};
+		if (!cache.value || cache.version != version_)
+			cache = global_cache_t{.version = version_,
+								   .value = lookup(symbol, *frame.env)};
+		return cache.value;
+	};
+
+	// whether everything after ip just leaves the chunk, a call there is in
+	// tail position
+	auto in_tail = [](const frame_t& frame)
+	{
+		size_t ip{frame.ip};
+		while (frame.chunk->code[ip].op == OPCODE::JUMP)
+			ip = frame.chunk->code[ip].a;
+		return frame.chunk->code[ip].op == OPCODE::RETURN;
+	};
+
+	// the frames pushed here count towards the depth limit until execute
+	// returns
+	struct depth_guard_t
+	{
+		size_t& depth;
+		size_t base;
+		~depth_guard_t()
+		{
+			depth = base;
+		}
+	} guard{depth_, depth_};
+
+	while (true)
+	{
+		// the depth limit was hit, possibly in a walk a builtin started
+		if (aborted_)
+			return {};
+
+		frame_t& frame{frames.back()};
+		const instr_t& ins{frame.chunk->code[frame.ip++]};
+
+		switch (ins.op)
+		{
+		case OPCODE::NIL:
+			stack.emplace_back();
+			break;
+		case OPCODE::CONST:
+			stack.push_back(frame.chunk->constants[ins.a]);
+			break;
+		case OPCODE::LOAD:
+		{
+			const token_t* value{load(frame, ins.a)};
+			if (!value)
+				raise(frame.chunk->errors[ins.e], frame.env);
+			stack.push_back(value ? *value : token_t{});
+		}
+		break;
+		case OPCODE::POP:
+			stack.pop_back();
+			break;
+		case OPCODE::JUMP:
+			frame.ip = ins.a;
+			break;
+		case OPCODE::JUMP_UNFOLDED:
+			if (unfolded())
+				frame.ip = ins.a;
+			break;
+		case OPCODE::JUMP_UNLESS:
+			if (!stack.back().is_true)
+				frame.ip = ins.a;
+			stack.pop_back();
+			break;
+		case OPCODE::EXPECT_BOOL:
+			if (stack.back().type != TOKEN_TYPE::BOOL)
+			{
+				stack.pop_back();
+				raise(frame.chunk->errors[ins.e], frame.env);
+				frame.ip = ins.a;
+			}
+			break;
+		case OPCODE::RAISE:
+			raise(frame.chunk->errors[ins.e], frame.env);
+			break;
+		case OPCODE::CALLEE:
+		{
+			const token_t* value{load(frame, ins.a)};
+			if (value)
+				stack.push_back(*value);
+			else
+				frame.ip = ins.b;
+		}
+		break;
+		case OPCODE::EXPECT_FN:
+			if (stack.back().type != TOKEN_TYPE::LAMBDA)
+			{
+				err_.emplace_back(
+					EvalError::Exception::NOT_A_FUNCTION, stack.back());
+				stack.back() = token_t{};
+				frame.ip = ins.a;
+			}
+			break;
+		case OPCODE::FUNCALL:
+			// a symbol naming a lambda is called the same way the lambda
+			// would be, so funcall 'f stays a tail call
+			if (stack.back().type == TOKEN_TYPE::SYMBOL)
+			{
+				const token_t* value{lookup(stack.back(), *frame.env)};
+				if (value && value->type == TOKEN_TYPE::LAMBDA)
+					stack.back() = *value;
+			}
+			if (stack.back().type != TOKEN_TYPE::LAMBDA)
+				frame.ip = ins.a;
+			break;
+		case OPCODE::FRAME:
+			pending.push_back(acquire_frame(*stack.back().env()));
+			break;
+		case OPCODE::ARG:
+			if (ins.a >= stack.back().apval().size())
+				frame.ip = ins.b;
+			break;
+		case OPCODE::BIND:
+		{
+			auto value{std::move(stack.back())};
+			stack.pop_back();
+			pending.back()->slots_[ins.a] = std::move(value);
+		}
+		break;
+		case OPCODE::CALL:
+		{
+			auto callee{std::move(stack.back())};
+			stack.pop_back();
+			auto callee_env{std::move(pending.back())};
+			pending.pop_back();
+			// a tail call isn't memoized, its arguments are gone by the time
+			// the result is known
+			const bool tail{callee.code() && frames.size() > 1 &&
+							in_tail(frame)};
+			MemoTable* memo{tail ? nullptr : memo_for(callee)};
+			if (memo)
+			{
+				if (auto hit{memo->find(callee, callee_env->slots_,
+										max_depth_ - depth_)})
+				{
+					peak_ = std::max(peak_, depth_ + hit->depth);
+					release_frame(std::move(callee_env));
+					stack.push_back(hit->value);
+					break;
+				}
+			}
+
+			if (tail)
+			{
+				// the callers frame is done, the callee takes its place and
+				// its lambda replaces the callers below the stack
+				if (frame.memo)
+					peak_ = std::max(frame.peak, peak_);
+				release_frame(std::move(frame.env));
+				frame = frame_t{.chunk = callee.code().get(),
+								.ip = 0,
+								.env = std::move(callee_env)};
+				stack.back() = std::move(callee);
+			}
+			else if (callee.code())
+			{
+				const size_t peak{memo ? std::exchange(peak_, depth_) : 0};
+				if (++depth_ > max_depth_)
+				{
+					exceed_depth(frame.chunk->constants[ins.a]);
+					return {};
+				}
+				peak_ = std::max(peak_, depth_);
+				frames.push_back(frame_t{.chunk = callee.code().get(),
+										 .ip = 0,
+										 .env = std::move(callee_env),
+										 .memo = memo,
+										 .errors = err_.size(),
+										 .peak = peak});
+				// the callees token holds the last reference to its code
+				// once its popped, so keep the lambda on the stack below
+				// the result
+				stack.push_back(std::move(callee));
+			}
+			else
+			{
+				const size_t errors{err_.size()};
+				const size_t peak{std::exchange(peak_, depth_)};
+				stack.push_back(walk(*callee.expr(), callee_env));
+				if (memo && err_.size() == errors && !aborted_)
+					memo->insert(callee, callee_env->slots_,
+								 {.value = stack.back(),
+								  .depth = peak_ - depth_});
+				peak_ = std::max(peak, peak_);
+				release_frame(std::move(callee_env));
+			}
+		}
+		break;
+		case OPCODE::BUILTIN:
+		{
+			const token_t& form{frame.chunk->constants[ins.a]};
+			const token_t& func{form.apval().front()};
+			std::vector<token_t> args{acquire_args()};
+			args.insert(args.end(),
+						std::make_move_iterator(std::prev(stack.end(), ins.b)),
+						std::make_move_iterator(stack.end()));
+			stack.resize(stack.size() - ins.b);
+
+			const builtin_t* builtin{find_builtin(func.pname)};
+			std::optional<token_t> res{};
+			if (builtin && builtin->builtin)
+				res = (this->*builtin->builtin)(form, func, args, frame.env);
+			release_args(std::move(args));
+			if (!res.has_value())
+				err_.emplace_back(
+					EvalError::Exception::UNDEFINED, func, frame.env);
+			stack.push_back(std::move(res).value_or(token_t{}));
+		}
+		break;
+		case OPCODE::GLOBAL_FRESH:
+			if (env_->find(frame.chunk->constants[ins.a]))
+			{
+				raise(frame.chunk->errors[ins.e], frame.env);
+				frame.ip = ins.b;
+			}
+			break;
+		case OPCODE::GLOBAL_BOUND:
+			if (!env_->find(frame.chunk->constants[ins.a]))
+			{
+				raise(frame.chunk->errors[ins.e], frame.env);
+				frame.ip = ins.b;
+			}
+			break;
+		case OPCODE::DEFINE:
+			env_->curr_env_.emplace(
+				frame.chunk->constants[ins.a].pname, std::move(stack.back()));
+			stack.pop_back();
+			changed_global(frame.chunk->constants[ins.a].pname);
+			break;
+		case OPCODE::SET:
+			env_->curr_env_.insert_or_assign(
+				frame.chunk->constants[ins.a].pname, std::move(stack.back()));
+			stack.pop_back();
+			changed_global(frame.chunk->constants[ins.a].pname);
+			break;
+		case OPCODE::CLOSURE:
+		{
+			const token_t& proto{frame.chunk->constants[ins.a]};
+			stack.push_back(token_t::make_lambda(
+				proto.apval(), proto.expr(), make_frame(proto, frame.env),
+				proto.code(), proto.pname));
+		}
+		break;
+		case OPCODE::DYNAMIC:
+		{
+			const token_t& form{frame.chunk->constants[ins.a]};
+			elements_t call{};
+			call.reserve(form.apval().size() - 1);
+			call.push_back(std::move(stack.back()));
+			stack.pop_back();
+			call.insert(call.end(), std::next(form.apval().begin(), 2),
+						form.apval().end());
+			stack.push_back(
+				walk(token_t::make_list(std::move(call)), frame.env));
+		}
+		break;
+		case OPCODE::WALK:
+			stack.push_back(walk(frame.chunk->constants[ins.a], frame.env));
+			break;
+		case OPCODE::FALLBACK:
+		{
+			const token_t& form{frame.chunk->constants[ins.a]};
+			const token_t& func{form.apval().front()};
+			// the special form already ran, only the builtin is left
+			const builtin_t* builtin{find_builtin(func.pname)};
+			const builtin_t plain{.name = func.pname,
+								  .builtin = builtin ? builtin->builtin
+													 : nullptr};
+			auto res{default_functions(
+				form, func, &plain, std::span{form.apval()}.subspan(1),
+				frame.env)};
+			if (!res.has_value())
+				err_.emplace_back(
+					EvalError::Exception::UNDEFINED, func, frame.env);
+			stack.push_back(std::move(res).value_or(token_t{}));
+		}
+		break;
+		case OPCODE::RETURN:
+		{
+			// the frame execute was called with belongs to the caller
+			if (frames.size() > 1)
+			{
+				// the lambda is below the result, a result that came with
+				// errors is never reused
+				const frame_t& done{frames.back()};
+				if (done.memo)
+				{
+					if (err_.size() == done.errors)
+						done.memo->insert(*std::prev(stack.end(), 2),
+										  done.env->slots_,
+										  {.value = stack.back(),
+										   .depth = peak_ - (depth_ - 1)});
+					peak_ = std::max(done.peak, peak_);
+				}
+				release_frame(std::move(frames.back().env));
+				depth_--;
+			}
+			frames.pop_back();
+			if (frames.empty())
+			{
+				assert(stack.size() == 1);
+				return std::move(stack.back());
+			}
+			// drop the lambda that was kept alive below the result
+			std::swap(stack.back(), *std::prev(stack.end(), 2));
+			stack.pop_back();
+		}
+		break;
+		}
+	}
+}
@@ -1,4 +1,8 @@
+#include <unistd.h>
+
 #include <cassert>
+#include <charconv>
+#include <clocale>
 #include <cstdio>
 #include <cstdlib>
 #include <format>
@@ -6,11 +10,17 @@
 #include <iostream>
 #include <memory>
 #include <ncpp/NotCurses.hh>
+#include <optional>
 #include <string_view>
 
+#include "heap.hpp"
 #include "interpreter.hpp"
+#include "memo.hpp"
+#include "output.hpp"
 #include "parser.hpp"
 
+using namespace std::string_view_literals;
+
 // Colors stolen from tokyo night
 const static auto kDEFAULT_COLOR = 0x7982A9u;
 const static auto kINFO_COLOR = 0xFFDB69u;
@@ -29,14 +39,163 @@ static std::vector<std::wstring> cmd_hist{};
 std::wstring
 PromptInput(ncpp::NotCurses &ncurses, std::shared_ptr<ncpp::Plane> plane);
 
-void PrintParseTokens(std::shared_ptr<ncpp::Plane> plane,
-					  std::vector<parse_token_t> input,
-					  const uint indent = 0);
+// Prints a result highlighted, straight from the token without turning it
+// into a string first
+void PrintToken(std::shared_ptr<ncpp::Plane> plane,
+				const token_t &token,
+				const uint indent = 0);
+
+// Writes a result and a newline to the output
+void WriteToken(OutputSink &output, const token_t &token);
+
+// Prints the prompts tokens from first on where they are in buf, top is the
+// row the prompt starts on
+void PrintPromptTokens(std::shared_ptr<ncpp::Plane> plane,
+					   std::wstring_view buf,
+					   const std::vector<lexed_token_t> &tokens,
+					   size_t first,
+					   uint top,
+					   uint indent);
+
+// The color a token is highlighted with, depth is the number of parens open
+// before it
+unsigned TokenColor(TOKEN_TYPE type, std::wstring_view str, uint depth);
 
 void PrintWelcome(std::shared_ptr<ncpp::Plane> plane);
 
-int main(void)
+// The command line, and what every option does for --help
+void PrintUsage(std::ostream &os, const char *name);
+void PrintOptions(std::ostream &os);
+
+void PrintHeapStats(Interpreter *interp, OutputSink &output);
+
+void PrintMemoStats(Interpreter *interp, OutputSink &output);
+
+int RunHeadless(Interpreter *interp, std::istream &in, OutputSink &output);
+
+int main(int argc, char *argv[])
 {
+	// Pick the engine the interpreter evaluates with, lets us A/B the tree
+	// walker against the bytecode VM
+	ENGINE engine{ENGINE::TREE};
+	// how deep evaluation may nest before its abandoned
+	size_t max_depth{Interpreter::kDEFAULT_MAX_DEPTH};
+	// how many threads the parallel builtins use, 0 for one per core
+	size_t threads{};
+	// write what the cycle collector did to the output file on exit
+	bool heap_stats{false};
+	// how many results of pure recursive functions are remembered, and
+	// whether to write how often they were reused on exit
+	size_t memo_size{MemoTable::kDEFAULT_CAPACITY};
+	bool memo_stats{false};
+	// the script to run without a terminal, - for stdin
+	std::string_view script{};
+	// when results are written out, by default every line for the REPL and
+	// in big blocks when headless
+	std::optional<FLUSH> flush{};
+	size_t flush_size{OutputSink::kDEFAULT_FLUSH_SIZE};
+	for (int i{1}; i < argc; i++)
+	{
+		std::string_view arg{argv[i]};
+		std::string_view value{i + 1 < argc ? argv[i + 1] : ""};
+		bool valid{true};
+		if (arg == "--help")
+		{
+			PrintUsage(std::cout, argv[0]);
+			PrintOptions(std::cout);
+			return EXIT_SUCCESS;
+		}
+		if (arg == "--heap-stats")
+		{
+			heap_stats = true;
+			continue;
+		}
+		if (arg == "--memo-stats")
+		{
+			memo_stats = true;
+			continue;
+		}
+		if (script.empty() && (arg == "-" || !arg.starts_with("-")))
+		{
+			script = arg;
+			continue;
+		}
+		if (arg == "--engine" && value == "tree"sv)
+			engine = ENGINE::TREE;
+		else if (arg == "--engine" && value == "bytecode"sv)
+			engine = ENGINE::BYTECODE;
+		else if (arg == "--max-depth")
+			valid = std::from_chars(value.data(),
+									value.data() + value.size(),
+									max_depth)
+						.ec == std::errc{};
+		else if (arg == "--threads")
+			valid = std::from_chars(value.data(),
+									value.data() + value.size(),
+									threads)
+						.ec == std::errc{};
+		else if (arg == "--memo-size")
+			valid = std::from_chars(value.data(),
+									value.data() + value.size(),
+									memo_size)
+						.ec == std::errc{};
+		else if (arg == "--flush" && value == "line"sv)
+			flush = FLUSH::LINE;
+		else if (arg == "--flush" && value == "exit"sv)
+			flush = FLUSH::EXIT;
+		else if (arg == "--flush")
+		{
+			flush = FLUSH::BYTES;
+			valid = std::from_chars(value.data(),
+									value.data() + value.size(),
+									flush_size)
+						.ec == std::errc{};
+		}
+		else
+			valid = false;
+
+		if (!valid)
+		{
+			PrintUsage(std::cerr, argv[0]);
+			return EXIT_FAILURE;
+		}
+		i++;
+	}
+
+	// A script, or input piped in, runs headless without ever setting up the
+	// terminal
+	if (script.empty() && !isatty(STDIN_FILENO))
+		script = "-";
+	if (!script.empty())
+	{
+		// notcurses sets the locale up for the REPL, errors go through wcerr
+		// which needs it to write anything but ascii
+		std::setlocale(LC_ALL, "");
+		Interpreter *interp{Interpreter::getInstance()};
+		interp->set_engine(engine);
+		interp->set_max_depth(max_depth);
+		interp->set_threads(threads);
+		interp->set_memo_size(memo_size);
+
+		OutputSink output{
+			STDOUT_FILENO, flush.value_or(FLUSH::BYTES), flush_size};
+		int status{EXIT_FAILURE};
+		if (script == "-")
+			status = RunHeadless(interp, std::cin, output);
+		else if (std::ifstream file{std::string{script},
+									std::ios_base::in |
+										std::ios_base::binary})
+			status = RunHeadless(interp, file, output);
+		else
+			std::cerr << "couldn't open " << script << "\n";
+
+		if (heap_stats)
+			PrintHeapStats(interp, output);
+		if (memo_stats)
+			PrintMemoStats(interp, output);
+		return status;
+	}
+
 	// Create the not curses instance, for use in handeling user input/output.
 	// It makes things pretty
 	notcurses_options opts{
@@ -53,15 +212,17 @@ int main(void)
 	std::shared_ptr<ncpp::Plane> command_plane(ncurses.get_stdplane());
 	command_plane->set_fg_rgb(kDEFAULT_COLOR);
 
-	// change where wcout goes, to save interpreters output to a file
-	std::wofstream output(
-		"output.txt", std::ios_base::trunc | std::ios_base::out);
-
-	// store the previous buffer to be swapped back too, stops a memory leak
-	auto cout_buf = std::wcout.rdbuf(output.rdbuf());
+	// save the interpreters output to a file
+	OutputSink output{std::filesystem::path{"output.txt"},
+					  flush.value_or(FLUSH::LINE),
+					  flush_size};
 
 	// grab the singelton interpreter
 	Interpreter *interp{Interpreter::getInstance()};
+	interp->set_engine(engine);
+	interp->set_max_depth(max_depth);
+	interp->set_threads(threads);
+	interp->set_memo_size(memo_size);
 
 	// Print hte welcom screen
 	PrintWelcome(command_plane);
@@ -102,23 +263,15 @@ int main(void)
 			// check that there were no evaluation errors
 			if (interp->get_error().empty())
 			{
-				// cast the result to a wstring, for printing purposes
-				auto str_res{static_cast<std::wstring>(res)};
-
 				// Output the result to the output file
-				std::wcout << str_res << std::endl;
+				WriteToken(output, res);
 
 				// Render the output to a the REPL plane
-				// We parse the string in as parse tokens so we can reuse our
-				// PrintParseTokens function for syntax highlighting
-				auto parsed_for_output = ParsePrintTokens(str_res);
-				assert(parsed_for_output.second.err ==
-					   ParserError::Exception::NONE);
 				command_plane->set_fg_rgb(0xA9B1D6);
 				command_plane->putstr(L"res> ");
 				command_plane->set_fg_rgb(kDEFAULT_COLOR);
 
-				PrintParseTokens(command_plane, parsed_for_output.first, 5);
+				PrintToken(command_plane, res, 5);
 				command_plane->putstr(L"\n");
 				ncurses.render();
 				ncurses.refresh({}, {});
@@ -135,7 +288,7 @@ int main(void)
 				command_plane->set_fg_rgb(kERROR_COLOR);
 				command_plane->putstr("EVAL ERROR: ");
 				command_plane->set_fg_rgb(kDEFAULT_COLOR);
-				auto error{interp->get_error().front()};
+				const auto &error{interp->get_error().front()};
 				command_plane->putstr(error.what());
 				command_plane->putstr(L"\n");
 
@@ -155,10 +308,114 @@ int main(void)
 	}
 
 exit:
-	std::wcout.rdbuf(cout_buf);
+	if (heap_stats)
+		PrintHeapStats(interp, output);
+	if (memo_stats)
+		PrintMemoStats(interp, output);
 	return EXIT_SUCCESS;
 };
 
+void PrintUsage(std::ostream &os, const char *name)
+{
+	os << "usage: " << name
+	   << " [--engine tree|bytecode] [--max-depth N]"
+		  " [--threads N] [--flush line|exit|BYTES]"
+		  " [--memo-size N] [--heap-stats] [--memo-stats]"
+		  " [script | -]\n";
+}
+
+void PrintOptions(std::ostream &os)
+{
+	os << std::format(
+		"\n"
+		"  --engine      walk the token tree, the default, or run bytecode\n"
+		"  --max-depth   how deep evaluation may nest, {} by default. The\n"
+		"                tree walker recurses on the native stack and stops\n"
+		"                once that is nearly used up, whatever the limit is.\n"
+		"                Only the bytecode engine can nest much deeper, and\n"
+		"                no form may nest deeper than {}\n"
+		"  --threads     threads for pmapcar, pfilter and preduce, 0 for one\n"
+		"                per core\n"
+		"  --flush       write results every line, at exit or every BYTES\n"
+		"  --memo-size   results of pure recursive functions to remember, off\n"
+		"                by default\n"
+		"  --heap-stats  write what the cycle collector did on exit\n"
+		"  --memo-stats  write how often remembered results were reused on\n"
+		"                exit\n",
+		Interpreter::kDEFAULT_MAX_DEPTH,
+		Interpreter::kMAX_NESTING);
+}
+
+void PrintHeapStats(Interpreter *interp, OutputSink &output)
+{
+	const heap_stats_t stats{interp->get_heap_stats()};
+	output.write_line(std::format(L"heap: {} collections, {} environments and "
+								  L"{} lists freed from cycles, {} and {} "
+								  L"watched, pauses {}us last {}us max",
+								  stats.collections,
+								  stats.freed_envs,
+								  stats.freed_objects,
+								  stats.envs,
+								  stats.objects,
+								  stats.last_pause.count(),
+								  stats.max_pause.count()));
+}
+
+void PrintMemoStats(Interpreter *interp, OutputSink &output)
+{
+	const memo_stats_t stats{interp->get_memo_stats()};
+	output.write_line(std::format(L"memo: {} hits, {} misses, {} evicted, {} "
+								  L"remembered",
+								  stats.hits,
+								  stats.misses,
+								  stats.evictions,
+								  stats.entries));
+}
+
+int RunHeadless(Interpreter *interp, std::istream &in, OutputSink &output)
+{
+	int status{EXIT_SUCCESS};
+	FormReader reader{in};
+	while (auto form{reader.next()})
+	{
+		auto parse_res{ParseEvalTokens(*form, true)};
+		if (parse_res.second.err != ParserError::Exception::NONE)
+		{
+			// the results before it come out first
+			output.flush();
+			std::wcerr << std::format(L"line {}: PARSE ERROR: {}\n",
+									  reader.line(),
+									  parse_res.second.what());
+			status = EXIT_FAILURE;
+			continue;
+		}
+
+		for (auto &i : parse_res.first)
+		{
+			interp->clear_error();
+			auto res{interp->eval(i)};
+			if (interp->get_error().empty())
+			{
+				WriteToken(output, res);
+				continue;
+			}
+
+			const auto &error{interp->get_error().front()};
+			if (error.err_ == EvalError::Exception::QUIT)
+				return status;
+			output.flush();
+			std::wcerr << std::format(
+				L"line {}: EVAL ERROR: {} TOKEN : {}\n",
+				reader.line(),
+				error.what(),
+				static_cast<std::wstring>(error.get_token()));
+			status = EXIT_FAILURE;
+			break;
+		}
+	}
+	return status;
+}
+
 void PrintWelcome(std::shared_ptr<ncpp::Plane> plane)
 {
 	auto msg{
@@ -199,12 +456,22 @@ PromptInput(ncpp::NotCurses &ncurses, std::shared_ptr<ncpp::Plane> plane)
 	size_t bpos{0};	 // cursor position in the buffer
 	ncinput ni;
 
+	// Only the part of the prompt a key changed is lexed and drawn again, so
+	// typing into a big pasted form doesn't redo all of it on every key
+	PromptLexer lexer{};
+	// the row the prompt started on when it was last drawn
+	uint drawn_top{y};
+
 	// While user is inputting characters
 	// false if there is an error in getting input
 	while (ncurses.get(true, &ni) != (uint32_t)-1)
 	{
 		if (ni.evtype == NCTYPE_RELEASE)
 			continue;
+		// what the key changed, erased characters at edit_pos replaced by
+		// inserted ones
+		bool changed{false};
+		size_t edit_pos{}, erased{}, inserted{};
 		if (ni.id == NCKEY_EOF || (ncinput_ctrl_p(&ni) && ni.id == 'D'))
 			return {};
 		else if (ni.id == NCKEY_ENTER)
@@ -220,6 +487,9 @@ PromptInput(ncpp::NotCurses &ncurses, std::shared_ptr<ncpp::Plane> plane)
 			{
 				buf.erase(bpos - 1, 1);
 				bpos--;
+				changed = true;
+				edit_pos = bpos;
+				erased = 1;
 			}
 			if (buf.empty())
 				edited = false;
@@ -228,6 +498,8 @@ PromptInput(ncpp::NotCurses &ncurses, std::shared_ptr<ncpp::Plane> plane)
 		else if (ni.id == 'U' && ncinput_ctrl_p(&ni))
 		{
 			buf.erase(0, bpos);
+			changed = true;
+			erased = bpos;
 			bpos = 0;
 			if (buf.empty())
 				edited = false;
@@ -256,7 +528,10 @@ PromptInput(ncpp::NotCurses &ncurses, std::shared_ptr<ncpp::Plane> plane)
 			if (!edited && cmd_hist_pos > 0)
 			{
 				cmd_hist_pos--;
+				changed = true;
+				erased = buf.size();
 				buf = cmd_hist[cmd_hist_pos];
+				inserted = buf.size();
 				bpos = buf.size() - 1;
 			}
 			// prompt navigation
@@ -272,6 +547,8 @@ PromptInput(ncpp::NotCurses &ncurses, std::shared_ptr<ncpp::Plane> plane)
 			if (!edited && cmd_hist_pos < cmd_hist.size())
 			{
 				cmd_hist_pos++;
+				changed = true;
+				erased = buf.size();
 				if (cmd_hist_pos == cmd_hist.size())
 				{
 					buf.erase();
@@ -280,6 +557,7 @@ PromptInput(ncpp::NotCurses &ncurses, std::shared_ptr<ncpp::Plane> plane)
 				else
 				{
 					buf = cmd_hist[cmd_hist_pos];
+					inserted = buf.size();
 					bpos = buf.size() - 1;
 				}
 			}
@@ -307,6 +585,9 @@ PromptInput(ncpp::NotCurses &ncurses, std::shared_ptr<ncpp::Plane> plane)
 			// normal input
 			edited = true;
 			buf.insert(bpos, 1, ni.id);
+			changed = true;
+			edit_pos = bpos;
+			inserted = 1;
 			bpos++;
 		}
 
@@ -314,22 +595,43 @@ PromptInput(ncpp::NotCurses &ncurses, std::shared_ptr<ncpp::Plane> plane)
 		// handles multi-line commands
 		const uint cxpos{static_cast<uint>(bpos % line_size)};
 		const uint cypos{static_cast<uint>(bpos / (line_size))};
-		ncplane_erase_region(plane->to_ncplane(), y - cypos, -1, INT_MAX, 0);
-		plane->printf(y - cypos, 0, "> ");
+		const uint top{y - cypos};
+		size_t first{changed ? lexer.edit(buf, edit_pos, erased, inserted)
+							 : lexer.tokens().size()};
+		// the whole prompt moved
+		if (top != drawn_top)
+			first = 0;
+
+		if (!first)
+		{
+			ncplane_erase_region(plane->to_ncplane(), top, -1, INT_MAX, 0);
+			plane->printf(top, 0, "> ");
+		}
+		else if (changed)
+		{
+			// everything from the first changed token on is drawn again,
+			// it moved when the edit changed the length of the buffer
+			const uint from{first < lexer.tokens().size()
+								? lexer.tokens()[first].begin
+								: static_cast<uint>(buf.size())};
+			ncplane_erase_region(plane->to_ncplane(), top + from / line_size,
+								 buf_indent + from % line_size, 1, INT_MAX);
+			ncplane_erase_region(plane->to_ncplane(),
+								 top + from / line_size + 1, 0, INT_MAX, 0);
+		}
+		drawn_top = top;
 
-		// Render the current input with syntax highlighting
-		auto tokens = ParsePrintTokens(buf);
-		PrintParseTokens(plane, tokens.first, buf_indent);
+		// Render the changed input with syntax highlighting
+		PrintPromptTokens(plane, buf, lexer.tokens(), first, top, buf_indent);
 		ncurses.cursor_enable(y, buf_indent + cxpos);
 		ncurses.render();
 	}
 	return buf;
 }
 
-void PrintParseTokens(std::shared_ptr<ncpp::Plane> plane,
-					  std::vector<parse_token_t> input,
-					  const uint indent)
-
+void PrintToken(std::shared_ptr<ncpp::Plane> plane,
+				const token_t &token,
+				const uint indent)
 {
 	uint x, y;
 	plane->get_cursor_yx(y, x);
@@ -338,50 +640,17 @@ void PrintParseTokens(std::shared_ptr<ncpp::Plane> plane,
 
 	// begin index
 	uint bi{0};
-	// number of unmatched paranthesis, positive is unmatched left (, negative
-	// is unmatched right )
-	int para_count{0};
-	for (auto &tok : input)
+	// number of unmatched left paranthesis
+	uint para_count{0};
+	for (TokenSpans spans{token}; auto span{spans.next()};)
 	{
-		auto str{tok.pname};
+		auto str{span->text};
 		// syntax highlighting based on the tokens type
-		switch (tok.type)
-		{
-		case TOKEN_TYPE::DELIM:
-			if (str == L"(")
-			{
-				if (para_count >= 0)
-					plane->set_fg_rgb(
-						kPARA_COLORS[para_count % kPARA_COLORS.size()]);
-				para_count++;
-			}
-			else if (str == L")")
-			{
-				if (para_count > 0)
-				{
-					para_count--;
-					plane->set_fg_rgb(
-						kPARA_COLORS[para_count % kPARA_COLORS.size()]);
-				}
-			}
-			else if (str == L"\'")
-				plane->set_fg_rgb(kQUOTE_COLOR);
-			break;
-		case TOKEN_TYPE::SYMBOL:
-			plane->set_fg_rgb(kSYMBOL_COLOR);
-			break;
-		case TOKEN_TYPE::INT:
-			plane->set_fg_rgb(kINT_COLOR);
-			break;
-		case TOKEN_TYPE::BOOL:
-			plane->set_fg_rgb(kBOOL_COLOR);
-			break;
-		case TOKEN_TYPE::LIST:
-		case TOKEN_TYPE::LAMBDA:
-			assert(false);
-		default:
-			plane->set_fg_rgb(kDEFAULT_COLOR);
-		}
+		plane->set_fg_rgb(TokenColor(span->type, str, para_count));
+		if (span->type == TOKEN_TYPE::DELIM && str == L"(")
+			para_count++;
+		else if (span->type == TOKEN_TYPE::DELIM && str == L")")
+			para_count--;
 
 		// Print the token
 		// line overflow
@@ -402,3 +671,67 @@ void PrintParseTokens(std::shared_ptr<ncpp::Plane> plane,
 		plane->set_fg_rgb(kDEFAULT_COLOR);
 	}
 }
+
+void WriteToken(OutputSink &output, const token_t &token)
+{
+	for (TokenSpans spans{token}; auto span{spans.next()};)
+		output.write(span->text);
+	output.write_line({});
+}
+
+void PrintPromptTokens(std::shared_ptr<ncpp::Plane> plane,
+					   std::wstring_view buf,
+					   const std::vector<lexed_token_t> &tokens,
+					   size_t first,
+					   uint top,
+					   uint indent)
+{
+	const uint line_size{plane->get_dim_x() - indent};
+	for (size_t i{first}; i < tokens.size(); i++)
+	{
+		const lexed_token_t &tok{tokens[i]};
+		auto str{buf.substr(tok.begin, tok.size)};
+		plane->set_fg_rgb(TokenColor(tok.type, str, tok.depth));
+
+		// the token can run over the end of a line
+		for (uint pos{tok.begin}; !str.empty();)
+		{
+			const size_t n{
+				std::min<size_t>(str.size(), line_size - pos % line_size)};
+			plane->putstr(top + pos / line_size,
+						  indent + pos % line_size,
+						  std::format(L"{}", str.substr(0, n)).c_str());
+			str.remove_prefix(n);
+			pos += n;
+		}
+
+		plane->set_fg_rgb(kDEFAULT_COLOR);
+	}
+}
+
+unsigned TokenColor(TOKEN_TYPE type, std::wstring_view str, uint depth)
+{
+	switch (type)
+	{
+	case TOKEN_TYPE::DELIM:
+		if (str == L"(")
+			return kPARA_COLORS[depth % kPARA_COLORS.size()];
+		// a ) gets the color of the ( it closes
+		if (str == L")" && depth)
+			return kPARA_COLORS[(depth - 1) % kPARA_COLORS.size()];
+		if (str == L"\'")
+			return kQUOTE_COLOR;
+		return kDEFAULT_COLOR;
+	case TOKEN_TYPE::SYMBOL:
+		return kSYMBOL_COLOR;
+	case TOKEN_TYPE::INT:
+		return kINT_COLOR;
+	case TOKEN_TYPE::BOOL:
+		return kBOOL_COLOR;
+	case TOKEN_TYPE::LIST:
+	case TOKEN_TYPE::LAMBDA:
+		assert(false);
+	default:
+		return kDEFAULT_COLOR;
+	}
+}
@@ -0,0 +1,233 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <format>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "interpreter.hpp"
+#include "parser.hpp"
+
+// Benchmarks, not run by ctest. LispInterpeterBench runs the ones named on
+// the command line, or all of them without any, and prints how long every
+// case of them took
+namespace
+{
+// how long running fn took, in seconds
+double Time(const std::function<void()> &fn)
+{
+	const auto start{std::chrono::steady_clock::now()};
+	fn();
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+										 start)
+		.count();
+}
+
+// Evaluates every form of source, the value of the last one printed. A
+// benchmark that raised an error has measured the wrong thing, so it stops
+std::wstring Eval(Interpreter &interp, std::wstring_view source)
+{
+	auto [tokens, err]{ParseEvalTokens(source)};
+	std::wstring ret{};
+	for (const token_t &i : tokens)
+	{
+		interp.clear_error();
+		token_t value{interp.eval(i)};
+		if (err.err != ParserError::Exception::NONE ||
+			!interp.get_error().empty())
+		{
+			std::wcerr << L"benchmark failed on " << std::wstring{source}
+					   << L"\n";
+			std::exit(EXIT_FAILURE);
+		}
+		ret = static_cast<std::wstring>(value);
+	}
+	return ret;
+}
+
+// Builds an n element list with a tail recursive cons loop, then walks it
+// with cdr twice. Linear when car, cdr and cons are constant time
+void ConsCdr()
+{
+	for (ENGINE engine : {ENGINE::TREE, ENGINE::BYTECODE})
+	{
+		Interpreter interp{};
+		interp.set_engine(engine);
+		interp.set_memo_size(0);
+		Eval(interp,
+			 L"(defun build (n acc)"
+			 L"  (if (== n 0) acc (build (- n 1) (cons n acc))))"
+			 L"(defun len (l acc)"
+			 L"  (if (== l '()) acc (len (cdr l) (+ acc 1))))"
+			 L"(defun sum (l acc)"
+			 L"  (if (== l '()) acc (sum (cdr l) (+ acc (car l)))))"
+			 L"(define l '())");
+		for (size_t n : {5000, 20000, 80000, 320000})
+		{
+			const double time{Time(
+				[&interp, n]()
+				{
+					Eval(interp,
+						 std::format(L"(set! l (build {} '()))", n) +
+							 L"(len l 0) (sum l 0) (set! l '())");
+				})};
+			std::cout << std::format(
+				"cons {:<8} n={:<7} {:.3f}s {:.0f}ns per element\n",
+				engine == ENGINE::TREE ? "tree" : "bytecode", n, time,
+				time * 1e9 / n);
+		}
+	}
+}
+
+// A loop whose every step calls global helpers that read a global variable,
+// among more globals than it uses. run-set sets a global on every step too,
+// so the globals keep changing
+void Globals()
+{
+	const size_t steps{1000000};
+	for (ENGINE engine : {ENGINE::TREE, ENGINE::BYTECODE})
+	{
+		Interpreter interp{};
+		interp.set_engine(engine);
+		interp.set_memo_size(0);
+		for (size_t i{0}; i < 1000; i++)
+			Eval(interp, std::format(L"(define g{} {})", i, i));
+		Eval(interp,
+			 L"(define step 1) (define total 0)"
+			 L"(defun inc (x) (+ x step))"
+			 L"(defun twice (x) (inc (inc x)))"
+			 L"(defun run (n acc)"
+			 L"  (if (== n 0) acc (run (- n 1) (twice acc))))"
+			 L"(defun run-set (n)"
+			 L"  (if (== n 0) total (next (set! total (twice total)) n)))"
+			 L"(defun next (set n) (run-set (- n 1)))");
+		const std::vector<std::pair<const char *, std::wstring>> loops{
+			{"run", std::format(L"(run {} 0)", steps)},
+			{"run-set", std::format(L"(run-set {})", steps)},
+		};
+		for (const auto &[name, call] : loops)
+		{
+			const double time{Time([&interp, &call]() { Eval(interp, call); })};
+			std::cout << std::format(
+				"globals {:<8} {:<8} {:.3f}s {:.0f}ns per step\n",
+				engine == ENGINE::TREE ? "tree" : "bytecode", name, time,
+				time * 1e9 / steps);
+		}
+	}
+}
+
+// Maps a pure function that takes a while over a list, with mapcar and with
+// pmapcar on pools of growing size
+void Pmapcar()
+{
+	const size_t elements{64};
+	std::wstring list{};
+	for (size_t i{0}; i < elements; i++)
+		list += std::format(L" {}", 16 + i % 4);
+	// no pool size gets past the number of cores
+	std::cout << std::format("pmapcar {} elements, {} cores\n", elements,
+							 std::thread::hardware_concurrency());
+
+	for (ENGINE engine : {ENGINE::TREE, ENGINE::BYTECODE})
+	{
+		const char *name{engine == ENGINE::TREE ? "tree" : "bytecode"};
+		Interpreter interp{};
+		interp.set_engine(engine);
+		interp.set_memo_size(0);
+		Eval(interp, L"(defun fib (n)"
+					 L"  (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))");
+		const std::wstring args{std::format(L" fib '({}))", list)};
+
+		const double serial{
+			Time([&interp, &args]() { Eval(interp, L"(mapcar" + args); })};
+		std::cout << std::format("pmapcar {:<8} mapcar     {:.3f}s\n", name,
+								 serial);
+		for (size_t threads : {1, 2, 4, 8})
+		{
+			interp.set_threads(threads);
+			// the first call starts the pool
+			Eval(interp, L"(pmapcar fib '(1))");
+			const double time{Time([&interp, &args]()
+								   { Eval(interp, L"(pmapcar" + args); })};
+			std::cout << std::format(
+				"pmapcar {:<8} {} threads  {:.3f}s {:.2f}x\n", name, threads,
+				time, serial / time);
+		}
+	}
+}
+
+// Parses a symbol dense corpus with both parsers. For reference, the same
+// atoms are also classified the way the parser used to, by trying stoi on
+// every one and catching the exception symbols throw
+void Parse()
+{
+	std::wstring corpus{};
+	for (size_t i{0}; i < 20000; i++)
+		corpus += std::format(L"(defun step-{} (acc item) (if (valid? item)"
+							  L" (cons (scale item {}) acc) acc))\n",
+							  i, i % 97);
+	const size_t repeats{3};
+
+	const double print{Time(
+		[&corpus, repeats]()
+		{
+			for (size_t i{0}; i < repeats; i++)
+				ParsePrintTokens(corpus);
+		})};
+	const double eval{Time(
+		[&corpus, repeats]()
+		{
+			for (size_t i{0}; i < repeats; i++)
+				ParseEvalTokens(corpus);
+		})};
+
+	// the parens are tokens too, but never were atoms
+	auto [tokens, err]{ParsePrintTokens(corpus)};
+	std::erase_if(tokens, [](const parse_token_t &i)
+				  { return i.type == TOKEN_TYPE::DELIM; });
+	const size_t atoms{tokens.size()};
+	size_t symbols{};
+	const double stoi{Time(
+		[&tokens, &symbols, repeats]()
+		{
+			for (size_t i{0}; i < repeats; i++)
+				for (const parse_token_t &j : tokens)
+					try
+					{
+						std::stoi(std::wstring{j.pname});
+					}
+					catch (const std::exception &)
+					{
+						symbols++;
+					}
+		})};
+
+	const double count{static_cast<double>(atoms * repeats)};
+	std::cout << std::format(
+		"parse {} atoms, {} of them symbols, {} times\n"
+		"parse ParsePrintTokens     {:.3f}s {:.0f}ns per atom\n"
+		"parse ParseEvalTokens      {:.3f}s {:.0f}ns per atom\n"
+		"parse stoi and catch alone {:.3f}s {:.0f}ns per atom\n",
+		atoms, symbols / repeats, repeats, print, print * 1e9 / count, eval,
+		eval * 1e9 / count, stoi, stoi * 1e9 / count);
+}
+}  // namespace
+
+int main(int argc, char *argv[])
+{
+	const std::vector<std::pair<std::string_view, void (*)()>> benchmarks{
+		{"cons", ConsCdr},
+		{"globals", Globals},
+		{"parse", Parse},
+		{"pmapcar", Pmapcar},
+	};
+
+	std::vector<std::string_view> names{argv + 1, argv + argc};
+	for (auto [name, benchmark] : benchmarks)
+		if (names.empty() || std::ranges::find(names, name) != names.end())
+			benchmark();
+}
@@ -0,0 +1,499 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <format>
+#include <new>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "interpreter.hpp"
+#include "parser.hpp"
+
+namespace
+{
+// how many times operator new ran while counting was set
+size_t allocations{};
+bool counting{};
+}  // namespace
+
+void *operator new(size_t size)
+{
+	if (counting)
+		allocations++;
+	if (void *ptr{std::malloc(size ? size : 1)})
+		return ptr;
+	throw std::bad_alloc{};
+}
+
+// not inlined, gcc takes a free inlined into a delete expression for a
+// mismatched deallocation
+[[gnu::noinline]] void operator delete(void *ptr) noexcept
+{
+	std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void *ptr, size_t) noexcept
+{
+	std::free(ptr);
+}
+
+namespace
+{
+// the forms of source, which has to parse
+std::vector<token_t> Parse(std::wstring_view source)
+{
+	auto [tokens, err]{ParseEvalTokens(source)};
+	EXPECT_EQ(err.err, ParserError::Exception::NONE) << err.what();
+	return tokens;
+}
+
+// Evaluates every form of source, the value of the last one printed or the
+// first error it raised
+std::wstring Eval(Interpreter &interp, std::wstring_view source)
+{
+	std::wstring ret{};
+	for (const token_t &i : Parse(source))
+	{
+		interp.clear_error();
+		token_t value{interp.eval(i)};
+		if (!interp.get_error().empty())
+			return std::wstring{L"ERROR "} + interp.get_error().front().what();
+		ret = static_cast<std::wstring>(value);
+	}
+	return ret;
+}
+
+// The value of the one form of source and every error it raised, with what
+// raised it
+std::wstring Report(Interpreter &interp, std::wstring_view source)
+{
+	interp.clear_error();
+	std::wstring ret{
+		static_cast<std::wstring>(interp.eval(Parse(source).front()))};
+	for (const EvalError &i : interp.get_error())
+		ret += std::format(L" [{}|{}]", i.what(),
+						   static_cast<std::wstring>(i.get_token()));
+	return ret;
+}
+
+// what evaluating form count times allocates, once it was evaluated before
+// so the pools are filled
+size_t Allocations(Interpreter &interp, const token_t &form, size_t count)
+{
+	interp.eval(form);
+	allocations = 0;
+	counting = true;
+	for (size_t i{0}; i < count; i++)
+		interp.eval(form);
+	counting = false;
+	return allocations;
+}
+
+class Engine : public testing::TestWithParam<ENGINE>
+{
+protected:
+	Interpreter interp_{};
+
+	void SetUp() override
+	{
+		interp_.set_engine(GetParam());
+	}
+};
+
+INSTANTIATE_TEST_SUITE_P(Engines,
+						 Engine,
+						 testing::Values(ENGINE::TREE, ENGINE::BYTECODE));
+}  // namespace
+
+// Atoms that start like a number but aren't one are symbols, they used to
+// end the process
+TEST(Parser, DigitsThenLetters)
+{
+	auto [tokens, err]{ParseEvalTokens(L"12a -3 +4 - 5x T")};
+	ASSERT_EQ(err.err, ParserError::Exception::NONE);
+	ASSERT_EQ(tokens.size(), 6);
+	EXPECT_EQ(tokens[0].type, TOKEN_TYPE::SYMBOL);
+	EXPECT_EQ(tokens[1].type, TOKEN_TYPE::INT);
+	EXPECT_EQ(tokens[2].type, TOKEN_TYPE::INT);
+	EXPECT_EQ(tokens[3].type, TOKEN_TYPE::SYMBOL);
+	EXPECT_EQ(tokens[4].type, TOKEN_TYPE::SYMBOL);
+	EXPECT_EQ(tokens[5].type, TOKEN_TYPE::BOOL);
+
+	Interpreter interp{};
+	EXPECT_EQ(Eval(interp, L"'12a"), L"12a");
+	EXPECT_EQ(Eval(interp, L"(+ 12a 3)"),
+			  L"ERROR Symbol is undefined in the environment");
+}
+
+TEST(Parser, IntLimits)
+{
+	Interpreter interp{};
+	EXPECT_EQ(Eval(interp, L"9223372036854775807"), L"9223372036854775807");
+	EXPECT_EQ(Eval(interp, L"-9223372036854775808"), L"-9223372036854775808");
+	EXPECT_EQ(Eval(interp, L"(- 9223372036854775808 1)"),
+			  L"9223372036854775807");
+	EXPECT_EQ(Eval(interp, L"99999999999999999999999"),
+			  L"99999999999999999999999");
+}
+
+// The end of an atom at the very end of the input is where the input ends
+TEST(Parser, LastAtomEnds)
+{
+	auto [tokens, err]{ParseEvalTokens(L"(a bc")};
+	EXPECT_EQ(err.err, ParserError::Exception::UNMATCHED_PARANTHESIS);
+	EXPECT_EQ(err.error_range_, std::make_pair(4u, 5u));
+}
+
+TEST_P(Engine, CarCdrOfTheEmptyList)
+{
+	EXPECT_EQ(Eval(interp_, L"(car '())"), L"()");
+	EXPECT_EQ(Eval(interp_, L"(cdr '())"), L"()");
+	EXPECT_EQ(Eval(interp_, L"(cdr (cdr '(1)))"), L"()");
+}
+
+// cons shares its tail, consing onto the same tail twice mustn't change
+// what the first cons or the tail hold
+TEST_P(Engine, ConsSharesTails)
+{
+	Eval(interp_, L"(define x '(2 3))(define a (cons 1 x))");
+	EXPECT_EQ(Eval(interp_, L"(cons 9 x)"), L"(9 2 3)");
+	EXPECT_EQ(Eval(interp_, L"a"), L"(1 2 3)");
+	EXPECT_EQ(Eval(interp_, L"x"), L"(2 3)");
+	EXPECT_EQ(Eval(interp_, L"(cons 0 (cdr a))"), L"(0 2 3)");
+	EXPECT_EQ(Eval(interp_, L"a"), L"(1 2 3)");
+}
+
+TEST_P(Engine, ListsMadeByCdrAndCons)
+{
+	EXPECT_EQ(Eval(interp_, L"(== (cdr '(1 2 3)) '(2 3))"), L"T");
+	EXPECT_EQ(Eval(interp_, L"(== (cons 1 (cdr '(0 2))) '(1 2))"), L"T");
+	EXPECT_EQ(Eval(interp_, L"(mapcar (lambda (x) (+ x 1)) (cdr '(1 2 3)))"),
+			  L"(3 4)");
+}
+
+// A compiled body remembers where it found the globals it uses. Setting one,
+// defining one it didn't find or growing the table past it has it look again
+TEST_P(Engine, GlobalsChangedUnderARunningLoop)
+{
+	interp_.set_memo_size(0);
+	Eval(interp_, L"(define k 1) (defun helper (x) (+ x k))"
+				  L"(defun loop (n acc)"
+				  L"  (if (== n 0) acc (loop (- n 1) (helper acc))))"
+				  L"(defun later () (+ k missing))");
+	EXPECT_EQ(Eval(interp_, L"(loop 10 0)"), L"10");
+	Eval(interp_, L"(set! k 2)");
+	EXPECT_EQ(Eval(interp_, L"(loop 10 0)"), L"20");
+	Eval(interp_, L"(set! helper (lambda (x) (* x 2)))");
+	EXPECT_EQ(Eval(interp_, L"(loop 3 1)"), L"8");
+
+	EXPECT_EQ(Eval(interp_, L"(later)"),
+			  L"ERROR Symbol is undefined in the environment");
+	Eval(interp_, L"(define missing 5)");
+	EXPECT_EQ(Eval(interp_, L"(later)"), L"7");
+	for (size_t i{0}; i < 1000; i++)
+		Eval(interp_, std::format(L"(define g{} {})", i, i));
+	Eval(interp_, L"(set! k 3)");
+	EXPECT_EQ(Eval(interp_, L"(later)"), L"8");
+	EXPECT_EQ(Eval(interp_, L"(loop 3 1)"), L"8");
+}
+
+// Bodies are folded when they are made, a builtin defined over later still
+// changes what they do, closures made before included
+TEST_P(Engine, FoldedBuiltinDefinedOver)
+{
+	Eval(interp_,
+		 L"(defun f (x) (* x (+ 1 2)))"
+		 L"(defun adder (n) (lambda (x) (+ x (* n (- 3 1)))))"
+		 L"(define add (adder 1))");
+	EXPECT_EQ(Eval(interp_, L"(f 1)"), L"3");
+	EXPECT_EQ(Eval(interp_, L"(add 1)"), L"3");
+
+	Eval(interp_, L"(define - (lambda (a b) (car '(99))))");
+	EXPECT_EQ(Eval(interp_, L"(add 1)"), L"100");
+	EXPECT_EQ(Eval(interp_, L"(funcall (adder 1) 1)"), L"100");
+	Eval(interp_, L"(define + (lambda (a b) (car '(99))))");
+	EXPECT_EQ(Eval(interp_, L"(f 1)"), L"99");
+}
+
+TEST_P(Engine, FoldedBodiesPrintAsWritten)
+{
+	EXPECT_EQ(Eval(interp_, L"(lambda (x) (* x (+ 1 2)))"),
+			  L"(x) (* x (+ 1 2))");
+	EXPECT_EQ(Eval(interp_, L"(defun g (x) (if T (+ 1 2) x)) g"),
+			  L"(x) (if T (+ 1 2) x)");
+	EXPECT_EQ(Eval(interp_, L"(g 0)"), L"3");
+}
+
+// cons evaluates its first argument again, so a constant one is code that
+// only runs when the body does
+TEST_P(Engine, FoldingLeavesConsToRun)
+{
+	Eval(interp_, L"(define x 1)(defun g () (cons '(set! x 5) '()))");
+	EXPECT_EQ(Eval(interp_, L"x"), L"1");
+	Eval(interp_, L"(g)");
+	EXPECT_EQ(Eval(interp_, L"x"), L"5");
+}
+
+TEST_P(Engine, FoldingDoesntCallWhatConsWould)
+{
+	Eval(interp_,
+		 L"(defun spin (n) (spin (+ n 1)))"
+		 L"(defun h () (cons '(spin 0) '()))");
+	EXPECT_EQ(Eval(interp_, L"(cons 1 '())"), L"(1)");
+}
+
+TEST_P(Engine, MemoIsOffByDefault)
+{
+	Eval(interp_, L"(defun dec (n) (if (== n 0) 0 (+ 1 (dec (- n 1)))))");
+	EXPECT_EQ(Eval(interp_, L"(dec 10)"), L"10");
+	EXPECT_EQ(Eval(interp_, L"(dec 10)"), L"10");
+	const memo_stats_t stats{interp_.get_memo_stats()};
+	EXPECT_EQ(stats.hits, 0);
+	EXPECT_EQ(stats.misses, 0);
+	EXPECT_EQ(stats.entries, 0);
+}
+
+// Every call of dec misses once, the two results of the deepest calls are
+// kept and the rest evicted. Results are dropped when a global changes, the
+// counts are kept
+TEST_P(Engine, MemoStats)
+{
+	interp_.set_memo_size(2);
+	Eval(interp_, L"(defun dec (n) (if (== n 0) 0 (+ 1 (dec (- n 1)))))");
+	EXPECT_EQ(Eval(interp_, L"(dec 3)"), L"3");
+	memo_stats_t stats{interp_.get_memo_stats()};
+	EXPECT_EQ(stats.hits, 0);
+	EXPECT_EQ(stats.misses, 4);
+	EXPECT_EQ(stats.evictions, 2);
+	EXPECT_EQ(stats.entries, 2);
+
+	EXPECT_EQ(Eval(interp_, L"(dec 3)"), L"3");
+	EXPECT_EQ(Eval(interp_, L"(dec 2)"), L"2");
+	stats = interp_.get_memo_stats();
+	EXPECT_EQ(stats.hits, 2);
+	EXPECT_EQ(stats.misses, 4);
+
+	EXPECT_EQ(Eval(interp_, L"(dec 1)"), L"1");
+	stats = interp_.get_memo_stats();
+	EXPECT_EQ(stats.hits, 2);
+	EXPECT_EQ(stats.misses, 6);
+	EXPECT_EQ(stats.evictions, 4);
+	EXPECT_EQ(stats.entries, 2);
+
+	Eval(interp_, L"(define x 1)");
+	EXPECT_EQ(Eval(interp_, L"(dec 1)"), L"1");
+	stats = interp_.get_memo_stats();
+	EXPECT_EQ(stats.hits, 2);
+	EXPECT_EQ(stats.misses, 8);
+	EXPECT_EQ(stats.entries, 2);
+}
+
+// cons evaluates its first argument again, which can be any form, so a
+// function consing one of its arguments isn't memoized
+TEST_P(Engine, ConsIsNotMemoized)
+{
+	interp_.set_memo_size(2);
+	Eval(interp_,
+		 L"(define x 0)"
+		 L"(defun f (k e) (if (== k 0) (cons e '()) (f (- k 1) e)))");
+	Eval(interp_, L"(f 2 '(set! x (+ x 1)))");
+	EXPECT_EQ(Eval(interp_, L"x"), L"1");
+	Eval(interp_, L"(f 2 '(set! x (+ x 1)))");
+	EXPECT_EQ(Eval(interp_, L"x"), L"2");
+	const memo_stats_t stats{interp_.get_memo_stats()};
+	EXPECT_EQ(stats.hits, 0);
+	EXPECT_EQ(stats.misses, 0);
+}
+
+// pmapcar returns what mapcar does, in the same order, and raises the errors
+// mapcar raises in the same order too, however many threads run it
+TEST_P(Engine, PmapcarMatchesMapcar)
+{
+	interp_.set_memo_size(0);
+	Eval(interp_, L"(defun sq (x) (* x x))");
+	std::wstring ints{}, mixed{};
+	for (size_t i{0}; i < 40; i++)
+	{
+		ints += std::format(L" {}", i);
+		// every fifth element can't be multiplied
+		mixed += i % 5 == 3 ? std::format(L" x{}", i) : std::format(L" {}", i);
+	}
+	for (size_t threads : {1, 4})
+	{
+		interp_.set_threads(threads);
+		for (const std::wstring &list : {ints, mixed})
+			for (std::wstring_view f : {L"sq", L"(lambda (x) (+ x 1))"})
+			{
+				const std::wstring args{std::format(L" {} '({}))", f, list)};
+				const std::wstring expected{Report(interp_, L"(mapcar" + args)};
+				EXPECT_EQ(Report(interp_, L"(pmapcar" + args), expected)
+					<< threads << L" threads";
+			}
+	}
+	EXPECT_EQ(Eval(interp_, L"(pmapcar sq '(1 2 3))"), L"(1 4 9)");
+}
+
+// Interpreters on separate threads share nothing but the interned symbols.
+// Each one sees only its own globals and its own heap collects the cycles
+// it made
+TEST(Threads, SeparateInterpreters)
+{
+	const size_t threads{8};
+	std::vector<std::vector<std::wstring>> results(threads);
+	std::vector<heap_stats_t> heaps(threads);
+	std::vector<std::thread> running{};
+	for (size_t i{0}; i < threads; i++)
+		running.emplace_back(
+			[i, &results, &heaps]()
+			{
+				Interpreter interp{};
+				interp.set_engine(i % 2 ? ENGINE::BYTECODE : ENGINE::TREE);
+				interp.set_memo_size(0);
+				Eval(interp,
+					 std::format(L"(define id {})", i) +
+						 L"(defun fib (n)"
+						 L"  (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+						 // cons writes the list a names into itself
+						 L"(defun mk (n)"
+						 L"  (funcall (lambda (a) (car (cons 'a a)))"
+						 L"  (cons n '())))"
+						 L"(defun loop (n acc)"
+						 L"  (if (== n 0) 0 (loop (- n 1) (mk n))))");
+				for (size_t j{0}; j < 10; j++)
+				{
+					Eval(interp, L"(loop 1000 0)");
+					results[i].push_back(Eval(interp, L"(+ id (fib 12))"));
+				}
+				heaps[i] = interp.get_heap_stats();
+			});
+	for (auto &i : running)
+		i.join();
+
+	for (size_t i{0}; i < threads; i++)
+	{
+		for (const std::wstring &j : results[i])
+			EXPECT_EQ(j, std::to_wstring(144 + i));
+		EXPECT_GT(heaps[i].freed_objects, 0);
+	}
+	Interpreter other{};
+	EXPECT_EQ(Eval(other, L"id"),
+			  L"ERROR Symbol is undefined in the environment");
+}
+
+// A depth limit the native stack can't hold doesn't crash the tree walker
+TEST(Depth, TreeWalkerStopsBeforeTheStackRunsOut)
+{
+	Interpreter interp{};
+	interp.set_memo_size(0);
+	interp.set_max_depth(10000000);
+	Eval(interp, L"(defun d (n) (if (== n 0) 0 (+ 1 (d (- n 1)))))");
+	EXPECT_EQ(Eval(interp, L"(d 5000000)"),
+			  L"ERROR Maximum evaluation depth exceeded");
+	EXPECT_EQ(Eval(interp, L"(d 100)"), L"100");
+}
+
+TEST(Depth, BytecodeUsesTheWholeLimit)
+{
+	Interpreter interp{};
+	interp.set_memo_size(0);
+	interp.set_engine(ENGINE::BYTECODE);
+	interp.set_max_depth(10000000);
+	Eval(interp, L"(defun d (n) (if (== n 0) 0 (+ 1 (d (- n 1)))))");
+	EXPECT_EQ(Eval(interp, L"(d 100000)"), L"100000");
+}
+
+// Going too deep is reported with the innermost call whose body couldn't go
+// on, whichever engine made it
+TEST(Depth, EnginesReportTheSameCall)
+{
+	Interpreter tree{}, bytecode{};
+	bytecode.set_engine(ENGINE::BYTECODE);
+	for (Interpreter *i : {&tree, &bytecode})
+	{
+		i->set_memo_size(0);
+		i->set_max_depth(500);
+		Eval(*i, L"(defun ev (n) (if (== n 0) T (od (- n 1))))"
+				 L"(defun od (n) (if (== n 0) NIL (not (ev (- n 1)))))"
+				 L"(defun deep (n) (if (== n 0) 0 (+ 1 (deep (- n 1)))))"
+				 L"(defun both (k) (if (== k 0) (deep 1000) (both (- k 1))))"
+				 L"(defun fd (n)"
+				 L"  (if (== n 0) 0 (+ 1 (funcall fd (- n 1)))))"
+				 L"(defun md (n)"
+				 L"  (if (== n 0) '(0)"
+				 L"    (mapcar (lambda (x) (+ x 1)) (md (- n 1)))))");
+	}
+	for (const wchar_t *call :
+		 {L"(deep 1000)", L"(+ 1 (deep 1000))", L"(od 1001)", L"(both 3)",
+		  L"(fd 1000)", L"(md 1000)", L"(funcall (lambda (n) (deep n)) 1000)"})
+	{
+		const std::wstring expected{Report(tree, call)};
+		EXPECT_NE(expected.find(L"[Maximum evaluation depth exceeded|"),
+				  std::wstring::npos)
+			<< call;
+		EXPECT_EQ(Report(bytecode, call), expected) << call;
+	}
+}
+
+TEST_P(Engine, NestingIsLimited)
+{
+	interp_.set_max_depth(10000000);
+	std::wstring form{};
+	for (size_t i{0}; i < Interpreter::kMAX_NESTING * 5; i++)
+		form += L"(+ 1 ";
+	form += L"1";
+	form.append(Interpreter::kMAX_NESTING * 5, L')');
+	EXPECT_EQ(Eval(interp_, form), L"ERROR Maximum evaluation depth exceeded");
+	EXPECT_EQ(Eval(interp_, L"(+ 1 (+ 1 1))"), L"3");
+}
+
+// Evaluating a builtin call takes its argument list from the pool, what's
+// left is the depth check of the top level form
+TEST(Allocations, BuiltinCall)
+{
+	Interpreter interp{};
+	const token_t form{Parse(L"(+ 1 2)").front()};
+	EXPECT_LE(Allocations(interp, form, 1000), 1000);
+	EXPECT_EQ(Eval(interp, L"(+ 1 2)"), L"3");
+}
+
+TEST(Allocations, CarCdr)
+{
+	Interpreter interp{};
+	Eval(interp, L"(define l '(1 2 3 4))");
+	const token_t form{Parse(L"(car (cdr (cdr l)))").front()};
+	EXPECT_LE(Allocations(interp, form, 1000), 1000);
+	EXPECT_EQ(Eval(interp, L"(car (cdr (cdr l)))"), L"3");
+}
+
+// A recursive walk down a list allocates next to nothing for each call it
+// makes, as long as it stays within what the frame pool keeps. The bytecode
+// engine's stacks still grow with the depth, which takes a few allocations
+// for the whole walk
+TEST_P(Engine, CarCdrWalkAllocations)
+{
+	interp_.set_memo_size(0);
+	auto ones = [](size_t count)
+	{
+		std::wstring ret{};
+		for (size_t i{0}; i < count; i++)
+			ret += L" 1";
+		return ret;
+	};
+	Eval(interp_,
+		 L"(defun sum (l) (if (== l '()) 0 (+ (car l) (sum (cdr l)))))"
+		 L"(define short '(" +
+			 ones(20) + L"))(define long '(" + ones(200) + L"))");
+	const token_t short_walk{Parse(L"(sum short)").front()};
+	const token_t long_walk{Parse(L"(sum long)").front()};
+	const size_t walks{100};
+	const size_t short_allocations{Allocations(interp_, short_walk, walks)};
+	const size_t long_allocations{Allocations(interp_, long_walk, walks)};
+	// the long walks make 180 more calls each, less than one in ten may
+	// allocate
+	EXPECT_LT(long_allocations - std::min(short_allocations, long_allocations),
+			  walks * 18);
+	EXPECT_EQ(Eval(interp_, L"(sum long)"), L"200");
+}